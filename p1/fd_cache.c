@@ -0,0 +1,202 @@
+#include "fd_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define NBUCKETS 1024 // Power of two, so a mask picks the bucket.
+
+struct fd_cache_stats fd_cache_stats;
+
+// Open descriptors and remembered failures are kept in LRU lists of their own,
+// each capped at max_entries, so probing for files that aren't there never
+// evicts a descriptor that is in use.
+struct lru_list {
+    struct fd_entry* head; // Most recently used.
+    struct fd_entry* tail; // Next to be evicted.
+};
+
+static struct fd_entry* buckets[NBUCKETS];
+static struct lru_list open_lru;
+static struct lru_list negative_lru;
+static int fd_cache_max_entries = 0;
+static int fd_cache_ttl = 1;
+
+// FNV-1a.
+static unsigned int hash_path(const char* path) {
+    unsigned int h = 2166136261u;
+    for (; *path; path++) {
+        h ^= (unsigned char) *path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static time_t now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+static struct lru_list* lru_of(struct fd_entry* e) {
+    return e->fd < 0 ? &negative_lru : &open_lru;
+}
+
+static void lru_unlink(struct fd_entry* e) {
+    struct lru_list* l = lru_of(e);
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        l->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        l->tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(struct fd_entry* e) {
+    struct lru_list* l = lru_of(e);
+    e->prev = NULL;
+    e->next = l->head;
+    if (l->head)
+        l->head->prev = e;
+    else
+        l->tail = e;
+    l->head = e;
+}
+
+// Take e out of the table. Its descriptor is closed once the last in-flight
+// response using it calls fd_cache_release().
+static void fd_cache_remove(struct fd_entry* e) {
+    struct fd_entry** p = &buckets[e->hash & (NBUCKETS - 1)];
+    while (*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
+    lru_unlink(e);
+
+    e->cached = 0;
+    if (e->fd < 0)
+        fd_cache_stats.negative_entries--;
+    else
+        fd_cache_stats.entries--;
+    fd_cache_release(e);
+}
+
+// Does st still describe the file we have open?
+static int same_file(const struct stat* a, const struct stat* b) {
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size
+        && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+void fd_cache_init(int max_entries, int ttl) {
+    fd_cache_max_entries = max_entries;
+    fd_cache_ttl = ttl;
+}
+
+struct fd_entry* fd_cache_open(const char* path) {
+    unsigned int h = hash_path(path);
+    time_t now = now_seconds();
+    struct fd_entry* e;
+    for (e = buckets[h & (NBUCKETS - 1)]; e; e = e->hnext) {
+        if (e->hash == h && !strcmp(e->path, path))
+            break;
+    }
+
+    // Past its TTL, check the path still names the same, unchanged file (or still
+    // names nothing at all).
+    if (e && now - e->validated >= fd_cache_ttl) {
+        struct stat st;
+        fd_cache_stats.revalidations++;
+        int found = stat(path, &st) == 0;
+        if (e->fd < 0 ? !found && errno == e->error : found && same_file(&st, &e->st)) {
+            e->validated = now;
+        } else {
+            fd_cache_stats.stale++;
+            fd_cache_remove(e);
+            e = NULL;
+        }
+    }
+
+    if (e) {
+        if (lru_of(e)->head != e) {
+            lru_unlink(e);
+            lru_push_front(e);
+        }
+        if (e->fd < 0) {
+            fd_cache_stats.negative_hits++;
+            errno = e->error;
+            return NULL;
+        }
+        fd_cache_stats.hits++;
+        e->refcount++;
+        return e;
+    }
+
+    fd_cache_stats.misses++;
+    e = calloc(1, sizeof(struct fd_entry));
+    if (!e)
+        return NULL;
+    e->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (e->fd < 0 && errno == ENOENT) {
+        e->error = errno;
+    } else if (e->fd < 0 || fstat(e->fd, &e->st) < 0) {
+        int saved = errno;
+        if (e->fd >= 0)
+            close(e->fd);
+        free(e);
+        errno = saved;
+        return NULL;
+    }
+    e->refcount = 1;
+    e->validated = now;
+
+    // Pipes and devices have no stable contents or shareable offset, don't keep them.
+    if (fd_cache_max_entries <= 0 || (e->fd >= 0 && !S_ISREG(e->st.st_mode)) || !(e->path = strdup(path))) {
+        if (e->fd < 0) {
+            free(e->path);
+            free(e);
+            errno = ENOENT;
+            return NULL;
+        }
+        return e;
+    }
+
+    struct lru_list* l = lru_of(e);
+    int* entries = e->fd < 0 ? &fd_cache_stats.negative_entries : &fd_cache_stats.entries;
+    while (l->tail && *entries >= fd_cache_max_entries) {
+        fd_cache_stats.evictions++;
+        fd_cache_remove(l->tail);
+    }
+
+    e->hash = h;
+    struct fd_entry** bucket = &buckets[h & (NBUCKETS - 1)];
+    e->hnext = *bucket;
+    *bucket = e;
+    lru_push_front(e);
+    e->cached = 1;
+    (*entries)++;
+    if (e->fd < 0) {
+        errno = e->error;
+        return NULL; // Only the cache holds a reference to a negative entry.
+    }
+    e->refcount++; // The cache's reference.
+    return e;
+}
+
+void fd_cache_release(struct fd_entry* entry) {
+    if (--entry->refcount == 0) {
+        if (entry->fd >= 0)
+            close(entry->fd);
+        free(entry->path);
+        free(entry);
+    }
+}
+
+void fd_cache_print_stats(FILE* out) {
+    fprintf(out, "Fd cache: %lu hits, %lu negative hits, %lu misses, %lu revalidations, %lu stale, %lu evictions, %d entries, %d negative entries\n",
+            fd_cache_stats.hits, fd_cache_stats.negative_hits, fd_cache_stats.misses, fd_cache_stats.revalidations, fd_cache_stats.stale,
+            fd_cache_stats.evictions, fd_cache_stats.entries, fd_cache_stats.negative_entries);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// An open file descriptor together with its fstat() results.
+struct fd_entry {
+    char* path;
+    int fd;              // -1 for a remembered failure, see error.
+    int error;           // errno of the failed open(), for negative entries.
+    struct stat st;
+    time_t validated;    // When st was last checked against the file on disk.
+
+    int refcount;        // The cache's own reference plus one per in-flight response.
+    int cached;          // Still reachable through the table? The fd is closed on the last release.
+    unsigned int hash;
+    struct fd_entry* hnext;  // Hash chain.
+    struct fd_entry* prev;   // LRU list, most recently used first.
+    struct fd_entry* next;
+};
+
+struct fd_cache_stats {
+    unsigned long hits;
+    unsigned long negative_hits; // Opens answered by a remembered ENOENT.
+    unsigned long misses;
+    unsigned long revalidations; // TTL expired and the file was stat()ed again.
+    unsigned long stale;         // Revalidation found the file changed and reopened it.
+    unsigned long evictions;
+    int entries;                 // Open descriptors.
+    int negative_entries;        // Remembered failures, capped separately.
+};
+
+extern struct fd_cache_stats fd_cache_stats;
+
+// Keep at most max_entries descriptors open, trusting their stat data for ttl seconds.
+// A zero max_entries disables caching, every open is then a plain open() + fstat().
+void fd_cache_init(int max_entries, int ttl);
+
+// Open path (read-only) through the cache. Returns a referenced entry, or NULL
+// with errno set. Only regular files are kept in the cache; anything else is
+// returned uncached and closed on release. Paths that don't exist are
+// remembered for the TTL too, so probing for optional files stays cheap; they
+// have a max_entries budget of their own and never push out open descriptors.
+struct fd_entry* fd_cache_open(const char* path);
+
+// Drop a reference returned by fd_cache_open().
+void fd_cache_release(struct fd_entry* entry);
+
+void fd_cache_print_stats(FILE* out);
@@ -0,0 +1,227 @@
+#include "file_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <zlib.h>
+
+#define NBUCKETS 4096 // Power of two, so a mask picks the bucket.
+
+struct cache_stats cache_stats;
+
+static struct cache_entry* buckets[NBUCKETS];
+static struct cache_entry* lru_head = NULL; // Most recently used.
+static struct cache_entry* lru_tail = NULL; // Next to be evicted.
+static size_t cache_max_bytes = 0;
+static size_t cache_max_file_size = 0;
+
+// FNV-1a.
+static unsigned int hash_path(const char* path) {
+    unsigned int h = 2166136261u;
+    for (; *path; path++) {
+        h ^= (unsigned char) *path;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void lru_unlink(struct cache_entry* e) {
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        lru_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        lru_tail = e->prev;
+    e->prev = e->next = NULL;
+}
+
+static void lru_push_front(struct cache_entry* e) {
+    e->prev = NULL;
+    e->next = lru_head;
+    if (lru_head)
+        lru_head->prev = e;
+    else
+        lru_tail = e;
+    lru_head = e;
+}
+
+static void entry_free(struct cache_entry* e) {
+    free(e->path);
+    free(e->data);
+    free(e->head);
+    free(e);
+}
+
+// Take e out of the table and LRU list. Its memory goes away once the last
+// in-flight response using it calls cache_release().
+static void cache_remove(struct cache_entry* e) {
+    struct cache_entry** p = &buckets[e->hash & (NBUCKETS - 1)];
+    while (*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
+    lru_unlink(e);
+
+    e->cached = 0;
+    cache_stats.bytes -= e->size;
+    cache_stats.entries--;
+    cache_release(e);
+}
+
+// Replace the size bytes at *data with their gzip encoding. Returns 0 on success.
+static int gzip_data(char** data, size_t* size) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return -1; // windowBits 15 + 16 asks zlib for a gzip rather than zlib wrapper.
+
+    size_t bound = deflateBound(&zs, *size);
+    char* out = malloc(bound);
+    if (!out) {
+        deflateEnd(&zs);
+        return -1;
+    }
+    zs.next_in = (Bytef*) *data;
+    zs.avail_in = *size;
+    zs.next_out = (Bytef*) out;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zs);
+        free(out);
+        return -1;
+    }
+    *size = zs.total_out;
+    deflateEnd(&zs);
+
+    free(*data);
+    char* shrunk = realloc(out, *size ? *size : 1);
+    *data = shrunk ? shrunk : out;
+    return 0;
+}
+
+int content_compressible(const char* contenttype) {
+    return !strncmp(contenttype, "text/", 5);
+}
+
+void cache_init(size_t max_bytes, size_t max_file_size) {
+    cache_max_bytes = max_bytes;
+    cache_max_file_size = max_file_size;
+}
+
+struct cache_entry* cache_lookup(const char* path, const char* encoding, const struct stat* st) {
+    unsigned int h = hash_path(path);
+    struct cache_entry* e;
+    for (e = buckets[h & (NBUCKETS - 1)]; e; e = e->hnext) {
+        if (e->hash == h && !strcmp(e->path, path) && !strcmp(e->encoding, encoding))
+            break;
+    }
+
+    if (e && (e->dev != st->st_dev || e->ino != st->st_ino || e->source_size != st->st_size
+              || e->mtime.tv_sec != st->st_mtim.tv_sec || e->mtime.tv_nsec != st->st_mtim.tv_nsec)) {
+        cache_stats.invalidations++;
+        cache_remove(e);
+        e = NULL;
+    }
+
+    if (!e) {
+        cache_stats.misses++;
+        return NULL;
+    }
+
+    cache_stats.hits++;
+    if (lru_head != e) {
+        lru_unlink(e);
+        lru_push_front(e);
+    }
+    e->refcount++;
+    return e;
+}
+
+struct cache_entry* cache_insert(const char* path, const char* encoding, int fd, const struct stat* st,
+                                 const char* contenttype, int compress) {
+    size_t size = st->st_size;
+    if (!S_ISREG(st->st_mode) || size > cache_max_file_size || size > cache_max_bytes)
+        return NULL;
+
+    struct cache_entry* e = calloc(1, sizeof(struct cache_entry));
+    if (!e)
+        return NULL;
+    e->path = strdup(path);
+    e->data = malloc(size ? size : 1);
+    e->head = malloc(320);
+    if (!e->path || !e->data || !e->head) {
+        entry_free(e);
+        return NULL;
+    }
+
+    // Read the whole file. A short read means it changed under us, so don't cache it.
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = pread(fd, e->data + got, size - got, got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            entry_free(e);
+            return NULL;
+        }
+        got += n;
+    }
+    if (compress) {
+        if (gzip_data(&e->data, &size) < 0) {
+            entry_free(e);
+            return NULL;
+        }
+        cache_stats.compressions++;
+    }
+
+    // Representations that vary by Accept-Encoding must say so, or shared caches
+    // would hand gzip to clients that never asked for it (or the reverse).
+    char encoding_headers[64] = "";
+    if (*encoding)
+        snprintf(encoding_headers, sizeof(encoding_headers), "Content-Encoding: %s\nVary: Accept-Encoding\n", encoding);
+    else if (content_compressible(contenttype))
+        strcpy(encoding_headers, "Vary: Accept-Encoding\n");
+
+    e->encoding = encoding;
+    e->size = size;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->source_size = st->st_size;
+    e->mtime = st->st_mtim;
+    e->content_type = contenttype;
+    http_format_etag(st, *encoding ? encoding : NULL, e->etag, HTTP_ETAG_LEN);
+    http_format_date(st->st_mtime, e->last_modified, HTTP_DATE_LEN);
+    e->head_len = snprintf(e->head, 320,
+                           "HTTP/1.1 200 OK\nContent-length: %lld\nContent-Type: %s\n%sETag: %s\nLast-Modified: %s\nAccept-Ranges: bytes\n",
+                           (long long) size, contenttype, encoding_headers, e->etag, e->last_modified);
+    e->hash = hash_path(path);
+
+    // Make room, least recently used first.
+    while (lru_tail && cache_stats.bytes + size > cache_max_bytes) {
+        cache_stats.evictions++;
+        cache_remove(lru_tail);
+    }
+
+    struct cache_entry** bucket = &buckets[e->hash & (NBUCKETS - 1)];
+    e->hnext = *bucket;
+    *bucket = e;
+    lru_push_front(e);
+    e->cached = 1;
+    e->refcount = 2; // The cache's reference and the caller's.
+    cache_stats.bytes += size;
+    cache_stats.entries++;
+    return e;
+}
+
+void cache_release(struct cache_entry* entry) {
+    if (--entry->refcount == 0)
+        entry_free(entry);
+}
+
+void cache_print_stats(FILE* out) {
+    fprintf(out, "Cache: %lu hits, %lu misses, %lu evictions, %lu invalidations, %lu compressions, %d entries, %zu bytes\n",
+            cache_stats.hits, cache_stats.misses, cache_stats.evictions, cache_stats.invalidations,
+            cache_stats.compressions, cache_stats.entries, cache_stats.bytes);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "http_parser.h"
+
+// A file held in memory together with the response headers that describe it.
+// One path may have several entries, one per content-coding it was sent with.
+struct cache_entry {
+    char* path;
+    const char* encoding; // Content-coding of data, "" for the file as is.
+    char* data;          // Whole file contents, encoded.
+    size_t size;
+    dev_t dev;           // dev/ino/mtime/size tell us when the file on disk changed.
+    ino_t ino;
+    off_t source_size;   // Size on disk, which differs from size once compressed.
+    struct timespec mtime;
+
+    const char* content_type;
+    char etag[HTTP_ETAG_LEN];
+    char last_modified[HTTP_DATE_LEN];
+    char* head;          // Pre-rendered status line and headers, minus Connection and the blank line.
+    int head_len;
+
+    int refcount;        // The cache's own reference plus one per in-flight response.
+    int cached;          // Still reachable through the table? Evicted entries live on until released.
+    unsigned int hash;
+    struct cache_entry* hnext;  // Hash chain.
+    struct cache_entry* prev;   // LRU list, most recently used first.
+    struct cache_entry* next;
+};
+
+struct cache_stats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations; // Entries dropped because the file changed on disk.
+    unsigned long compressions;  // Files gzipped on the way into the cache.
+    size_t bytes;                // Bytes of file data currently cached.
+    int entries;
+};
+
+extern struct cache_stats cache_stats;
+
+// Set the total size of the cache and the largest file it will hold. A zero
+// max_bytes disables caching.
+void cache_init(size_t max_bytes, size_t max_file_size);
+
+// Is contenttype worth compressing? Text is; images and binaries already are
+// compressed or wouldn't benefit.
+int content_compressible(const char* contenttype);
+
+// Find the encoding ("" for none) of path in the cache. st must describe the
+// file the entry was read from as it is currently on disk; stale entries are
+// dropped. Returns a referenced entry, or NULL on a miss.
+struct cache_entry* cache_lookup(const char* path, const char* encoding, const struct stat* st);
+
+// Read the file open on fd into the cache as the encoding of path, pre-rendering
+// its headers. With compress set the contents are gzipped on the way in (encoding
+// should then be "gzip"), otherwise the file is taken to be encoded already.
+// Returns a referenced entry, or NULL if the file can't or shouldn't be cached.
+struct cache_entry* cache_insert(const char* path, const char* encoding, int fd, const struct stat* st,
+                                 const char* contenttype, int compress);
+
+// Drop a reference returned by cache_lookup() or cache_insert().
+void cache_release(struct cache_entry* entry);
+
+void cache_print_stats(FILE* out);
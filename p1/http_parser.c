@@ -0,0 +1,413 @@
+#define _GNU_SOURCE // strptime(), timegm()
+#include "http_parser.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+
+enum {
+    S_START,          // Skipping blank lines before the request line.
+    S_METHOD,
+    S_TARGET,
+    S_VERSION,
+    S_REQUEST_LINE_LF,
+    S_HEADER_START,   // Beginning of a header line, or the blank line ending the head.
+    S_HEADER_NAME,
+    S_HEADER_VALUE_WS,
+    S_HEADER_VALUE,
+    S_HEADER_LF,
+    S_FINAL_LF,
+    S_DONE
+};
+
+// RFC 7230 tchar: the characters allowed in methods and header names.
+static const char tchar[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1, ['*'] = 1, ['+'] = 1,
+    ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1, ['`'] = 1, ['|'] = 1, ['~'] = 1,
+    ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+    ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1,
+    ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1,
+    ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+    ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1,
+    ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1, ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1,
+    ['s'] = 1, ['t'] = 1, ['u'] = 1, ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+};
+
+void http_request_init(struct http_request* req) {
+    memset(req, 0, sizeof(struct http_request));
+    req->state = S_START;
+}
+
+int http_str_eq(struct http_str s, const char* lit) {
+    int len = strlen(lit);
+    return s.p && s.len == len && !strncasecmp(s.p, lit, len);
+}
+
+int http_str_has_token(struct http_str s, const char* token) {
+    int tokenlen = strlen(token);
+    const char* p = s.p;
+    const char* end = s.p + s.len;
+    while (p && p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char* start = p;
+        while (p < end && *p != ',' && *p != ';') // Ignore parameters such as ";q=0.5".
+            p++;
+        const char* stop = p;
+        while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t'))
+            stop--;
+        if (stop - start == tokenlen && !strncasecmp(start, token, tokenlen))
+            return 1;
+        while (p < end && *p != ',')
+            p++;
+    }
+    return 0;
+}
+
+int http_accepts_encoding(struct http_str s, const char* coding) {
+    int codinglen = strlen(coding);
+    int wildcard = 0;
+    const char* p = s.p;
+    const char* end = s.p + s.len;
+    while (p && p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        const char* start = p;
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t')
+            p++;
+        int len = p - start;
+
+        // A weight of zero ("q=0", "q=0.000") means "not acceptable".
+        int refused = 0;
+        const char* q = p;
+        while (q < end && *q != ',')
+            q++;
+        for (const char* w = p; w + 2 <= q; w++) {
+            if ((w[0] == 'q' || w[0] == 'Q') && w[1] == '=') {
+                refused = 1;
+                for (w += 2; w < q && *w != ';' && *w != ' ' && *w != '\t'; w++) {
+                    if (*w != '0' && *w != '.')
+                        refused = 0;
+                }
+                break;
+            }
+        }
+        p = q;
+
+        if (len == codinglen && !strncasecmp(start, coding, len))
+            return !refused;
+        if (len == 1 && *start == '*')
+            wildcard = refused ? -1 : 1;
+    }
+    return wildcard > 0;
+}
+
+// Remember the value of the header we just finished, if it is one we care about.
+static void store_header(struct http_request* req, const char* buf, struct http_str value) {
+    struct http_str name = { buf + req->name_mark, req->name_len };
+    req->header_count++;
+
+    switch (name.len) {
+        case 4:
+            if (http_str_eq(name, "Host")) req->host = value;
+            break;
+        case 5:
+            if (http_str_eq(name, "Range")) req->range = value;
+            break;
+        case 8:
+            if (http_str_eq(name, "If-Range")) req->if_range = value;
+            break;
+        case 10:
+            if (http_str_eq(name, "Connection")) req->connection = value;
+            break;
+        case 13:
+            if (http_str_eq(name, "If-None-Match")) req->if_none_match = value;
+            break;
+        case 15:
+            if (http_str_eq(name, "Accept-Encoding")) req->accept_encoding = value;
+            break;
+        case 17:
+            if (http_str_eq(name, "If-Modified-Since")) req->if_modified_since = value;
+            break;
+    }
+}
+
+int http_parse(struct http_request* req, const char* buf, int len) {
+    int pos = req->pos;
+    int state = req->state;
+
+    for (; pos < len && state != S_DONE; pos++) {
+        unsigned char ch = buf[pos];
+        switch (state) {
+            case S_START:
+                if (ch == '\r' || ch == '\n')
+                    break;
+                if (!tchar[ch])
+                    return HTTP_PARSE_ERROR;
+                req->mark = pos;
+                state = S_METHOD;
+                break;
+
+            case S_METHOD:
+                if (ch == ' ') {
+                    req->method.p = buf + req->mark;
+                    req->method.len = pos - req->mark;
+                    req->mark = pos + 1;
+                    state = S_TARGET;
+                } else if (!tchar[ch]) {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case S_TARGET:
+                if (ch == ' ') {
+                    if (pos == req->mark)
+                        return HTTP_PARSE_ERROR;
+                    req->target.p = buf + req->mark;
+                    req->target.len = pos - req->mark;
+                    req->mark = pos + 1;
+                    state = S_VERSION;
+                } else if (ch <= ' ' || ch == 0x7f) {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case S_VERSION:
+                if (ch == '\r' || ch == '\n') {
+                    const char* v = buf + req->mark;
+                    if (pos - req->mark != 8 || strncmp(v, "HTTP/", 5) || v[6] != '.'
+                        || v[5] < '0' || v[5] > '9' || v[7] < '0' || v[7] > '9')
+                        return HTTP_PARSE_ERROR;
+                    req->version_major = v[5] - '0';
+                    req->version_minor = v[7] - '0';
+                    state = (ch == '\r') ? S_REQUEST_LINE_LF : S_HEADER_START;
+                }
+                break;
+
+            case S_REQUEST_LINE_LF:
+            case S_HEADER_LF:
+                if (ch != '\n')
+                    return HTTP_PARSE_ERROR;
+                state = S_HEADER_START;
+                break;
+
+            case S_HEADER_START:
+                if (ch == '\r') {
+                    state = S_FINAL_LF;
+                } else if (ch == '\n') {
+                    state = S_DONE;
+                } else if (tchar[ch]) {
+                    req->name_mark = pos;
+                    state = S_HEADER_NAME;
+                } else {
+                    return HTTP_PARSE_ERROR; // Includes obsolete line folding.
+                }
+                break;
+
+            case S_HEADER_NAME:
+                if (ch == ':') {
+                    req->name_len = pos - req->name_mark;
+                    state = S_HEADER_VALUE_WS;
+                } else if (!tchar[ch]) {
+                    return HTTP_PARSE_ERROR;
+                }
+                break;
+
+            case S_HEADER_VALUE_WS:
+                if (ch == ' ' || ch == '\t')
+                    break;
+                req->mark = pos;
+                state = S_HEADER_VALUE;
+                // Fall through, the value may be empty.
+            case S_HEADER_VALUE:
+                if (ch == '\r' || ch == '\n') {
+                    int end = pos;
+                    while (end > req->mark && (buf[end - 1] == ' ' || buf[end - 1] == '\t'))
+                        end--;
+                    struct http_str value = { buf + req->mark, end - req->mark };
+                    store_header(req, buf, value);
+                    state = (ch == '\r') ? S_HEADER_LF : S_HEADER_START;
+                }
+                break;
+
+            case S_FINAL_LF:
+                if (ch != '\n')
+                    return HTTP_PARSE_ERROR;
+                state = S_DONE;
+                break;
+        }
+    }
+
+    req->pos = pos;
+    req->state = state;
+    if (state != S_DONE)
+        return HTTP_PARSE_INCOMPLETE;
+    req->length = pos;
+    return HTTP_PARSE_DONE;
+}
+
+// Parse a run of decimal digits at *p. Returns -1 if there are none or they overflow.
+static off_t parse_offset(const char** p, const char* end) {
+    off_t value = 0;
+    const char* start = *p;
+    for (; *p < end && **p >= '0' && **p <= '9'; (*p)++) {
+        if (value > (((off_t) 1 << 62) - 1) / 10)
+            return -1;
+        value = value * 10 + (**p - '0');
+    }
+    return (*p == start) ? -1 : value;
+}
+
+int http_parse_ranges(struct http_str value, off_t size, struct http_range* out, int max) {
+    if (!value.p || value.len < 6 || strncasecmp(value.p, "bytes=", 6))
+        return -1;
+
+    const char* p = value.p + 6;
+    const char* end = value.p + value.len;
+    int n = 0;
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (p < end && *p == ',') { // Empty list elements are allowed.
+            p++;
+            continue;
+        }
+
+        off_t first, last;
+        if (p < end && *p == '-') { // Suffix range: the last N bytes.
+            p++;
+            off_t suffix = parse_offset(&p, end);
+            if (suffix < 0)
+                return -1;
+            first = (suffix < size) ? size - suffix : 0;
+            last = (suffix > 0) ? size - 1 : -1;
+        } else {
+            first = parse_offset(&p, end);
+            if (first < 0 || p == end || *p++ != '-')
+                return -1;
+            last = size - 1;
+            if (p < end && *p >= '0' && *p <= '9') {
+                last = parse_offset(&p, end);
+                if (last < first)
+                    return -1;
+                if (last >= size)
+                    last = size - 1;
+            }
+        }
+
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        if (p < end && *p++ != ',')
+            return -1;
+
+        if (first >= size || last < first)
+            continue; // Unsatisfiable, but others in the list may still be fine.
+        if (n == max)
+            return -1;
+        out[n].start = first;
+        out[n].end = last;
+        n++;
+    }
+    return n;
+}
+
+int http_format_etag(const struct stat* st, const char* coding, char* buf, int buflen) {
+    return snprintf(buf, buflen, "\"%llx-%llx-%llx%s%s\"", (unsigned long long) st->st_ino,
+                    (unsigned long long) st->st_size,
+                    (unsigned long long) st->st_mtim.tv_sec * 1000000000ULL + st->st_mtim.tv_nsec,
+                    coding ? "-" : "", coding ? coding : "");
+}
+
+int http_format_date(time_t t, char* buf, int buflen) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    return strftime(buf, buflen, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+int http_parse_date(struct http_str value, time_t* out) {
+    static const char* formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",  // IMF-fixdate, what everyone sends today.
+        "%A, %d-%b-%y %H:%M:%S GMT",  // RFC 850.
+        "%a %b %e %H:%M:%S %Y",       // asctime().
+    };
+    char date[HTTP_DATE_LEN + 8];
+    if (!value.p || value.len >= (int) sizeof(date))
+        return -1;
+    memcpy(date, value.p, value.len);
+    date[value.len] = '\0';
+
+    for (int i = 0; i < (int) (sizeof(formats) / sizeof(formats[0])); i++) {
+        struct tm tm;
+        memset(&tm, 0, sizeof(tm));
+        const char* end = strptime(date, formats[i], &tm);
+        if (end && *end == '\0') {
+            *out = timegm(&tm);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int http_etag_list_matches(struct http_str value, const char* etag) {
+    int etaglen = strlen(etag);
+    const char* p = value.p;
+    const char* end = value.p + value.len;
+    while (p && p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+            p++;
+        if (p < end && *p == '*')
+            return 1;
+        if (end - p >= 2 && p[0] == 'W' && p[1] == '/')
+            p += 2;
+        const char* start = p;
+        while (p < end && *p != ',')
+            p++;
+        const char* stop = p;
+        while (stop > start && (stop[-1] == ' ' || stop[-1] == '\t'))
+            stop--;
+        if (stop - start == etaglen && !memcmp(start, etag, etaglen))
+            return 1;
+    }
+    return 0;
+}
+
+static int hexval(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+int http_decode_path(struct http_str target, char* dst, int dstlen) {
+    const char* p = target.p;
+    const char* end = target.p + target.len;
+
+    // Absolute-form ("http://host/path"): skip to the path.
+    if (p < end && *p != '/') {
+        const char* scheme = memchr(p, ':', end - p);
+        if (!scheme || end - scheme < 3 || scheme[1] != '/' || scheme[2] != '/')
+            return -1;
+        p = memchr(scheme + 3, '/', end - (scheme + 3));
+        if (!p)
+            p = end;
+    }
+
+    int n = 0;
+    for (; p < end && *p != '?' && *p != '#'; p++) {
+        char ch = *p;
+        if (ch == '%') {
+            int hi, lo;
+            if (end - p < 3 || (hi = hexval(p[1])) < 0 || (lo = hexval(p[2])) < 0)
+                return -1;
+            ch = (char) (hi << 4 | lo);
+            if (ch == '\0')
+                return -1;
+            p += 2;
+        }
+        if (n + 1 >= dstlen)
+            return -1;
+        dst[n++] = ch;
+    }
+    dst[n] = '\0';
+    return n;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+// Incremental HTTP/1.x request parser. It never allocates: every field is a
+// view into the caller's receive buffer, which must stay in place (and keep
+// the same address) until the request has been answered.
+
+// A string inside the receive buffer. Not NUL-terminated.
+struct http_str {
+    const char* p;
+    int len;
+};
+
+enum http_parse_status {
+    HTTP_PARSE_ERROR = -1,      // Malformed request, answer 400 and close.
+    HTTP_PARSE_INCOMPLETE = 0,  // Need more bytes, call again once they arrive.
+    HTTP_PARSE_DONE = 1         // Request line and all headers parsed.
+};
+
+struct http_request {
+    // Parser state, so a request split across reads is picked up where it stopped.
+    int state;
+    int pos;          // Bytes of the buffer consumed so far.
+    int mark;         // Start of the token being scanned.
+    int name_mark;    // Start of the current header name.
+    int name_len;
+
+    struct http_str method;
+    struct http_str target;   // Raw request-target, still percent-encoded.
+    int version_major;
+    int version_minor;
+
+    // Headers we act on. Empty (p == NULL) when not sent.
+    struct http_str host;
+    struct http_str connection;
+    struct http_str range;
+    struct http_str if_modified_since;
+    struct http_str if_none_match;
+    struct http_str if_range;
+    struct http_str accept_encoding;
+    int header_count;
+
+    int length;       // Bytes of the request head, including the blank line, once done.
+};
+
+void http_request_init(struct http_request* req);
+
+// Parse buf[0..len). buf must begin with the request (the same buffer on every
+// call); bytes already consumed on earlier calls are not looked at again.
+int http_parse(struct http_request* req, const char* buf, int len);
+
+// Case-insensitive comparison of s against lit.
+int http_str_eq(struct http_str s, const char* lit);
+
+// Does the comma-separated header value s contain token (case-insensitive)?
+int http_str_has_token(struct http_str s, const char* token);
+
+// Does the Accept-Encoding value s allow coding? Honours "q=0" and "*".
+int http_accepts_encoding(struct http_str s, const char* coding);
+
+// One satisfiable byte range, both ends inclusive.
+struct http_range {
+    off_t start;
+    off_t end;
+};
+
+// Resolve a Range header value against a representation of size bytes into at
+// most max ranges. Returns the number of satisfiable ranges (0 means answer
+// 416), or -1 if the header is malformed or asks for too many ranges, in which
+// case it should be ignored and the whole file sent.
+int http_parse_ranges(struct http_str value, off_t size, struct http_range* out, int max);
+
+#define HTTP_ETAG_LEN 64
+#define HTTP_DATE_LEN 32
+
+// Strong entity tag for a file, from its inode, size and modification time.
+// A content-coding (or NULL) tells encoded representations of it apart.
+int http_format_etag(const struct stat* st, const char* coding, char* buf, int buflen);
+
+// Format t as an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT".
+int http_format_date(time_t t, char* buf, int buflen);
+
+// Parse an HTTP-date in any of the three formats clients may send. Returns 0 on success.
+int http_parse_date(struct http_str value, time_t* out);
+
+// Does the If-None-Match list value match etag? Uses weak comparison, "*" matches anything.
+int http_etag_list_matches(struct http_str value, const char* etag);
+
+// Percent-decode the path of a request-target (dropping any ?query) into dst as
+// a NUL-terminated string. Returns the decoded length, or -1 if it is malformed,
+// contains a NUL byte, or doesn't fit in dstlen.
+int http_decode_path(struct http_str target, char* dst, int dstlen);
@@ -0,0 +1,98 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "http_parser.h"
+
+// Microbenchmark for http_parser.c. Usage: ./parser_bench [iterations]
+// Parses a few representative requests, both in one piece and fed a few bytes
+// at a time (as partial reads would deliver them), and reports requests per second.
+
+static const char* requests[] = {
+    "GET /index.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/7.88.1\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    "GET /images/photo%20of%20campus.jpg HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0 Safari/537.36\r\n"
+    "Accept: image/avif,image/webp,image/apng,image/*,*/*;q=0.8\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "If-None-Match: \"5f3a-1d2c-65a1b2c3\"\r\n"
+    "If-Modified-Since: Sat, 14 Oct 2026 10:00:00 GMT\r\n"
+    "\r\n",
+
+    "GET /downloads/big.bin HTTP/1.1\r\n"
+    "Host: localhost\r\n"
+    "Range: bytes=1048576-2097151\r\n"
+    "\r\n",
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Parse every request iterations times, handing the parser chunk bytes more on
+// each call (0 means the whole request at once).
+static void run(const char* label, long iterations, int chunk) {
+    int nreq = sizeof(requests) / sizeof(requests[0]);
+    int lens[nreq];
+    long bytes = 0;
+    for (int i = 0; i < nreq; i++)
+        lens[i] = strlen(requests[i]);
+
+    struct http_request req;
+    long parsed = 0;
+    int checksum = 0; // Keeps the compiler from discarding the work.
+    double start = now();
+    for (long it = 0; it < iterations; it++) {
+        for (int i = 0; i < nreq; i++) {
+            http_request_init(&req);
+            int status = HTTP_PARSE_INCOMPLETE;
+            if (chunk == 0) {
+                status = http_parse(&req, requests[i], lens[i]);
+            } else {
+                for (int avail = chunk; status == HTTP_PARSE_INCOMPLETE; avail += chunk)
+                    status = http_parse(&req, requests[i], avail < lens[i] ? avail : lens[i]);
+            }
+            if (status != HTTP_PARSE_DONE) {
+                fprintf(stderr, "Failed to parse request %d\n", i);
+                exit(1);
+            }
+            checksum += req.header_count + req.target.len;
+            bytes += lens[i];
+            parsed++;
+        }
+    }
+    double elapsed = now() - start;
+
+    printf("%-24s %12.0f req/s %10.1f MB/s  (%ld requests, checksum %d)\n",
+           label, parsed / elapsed, bytes / elapsed / 1e6, parsed, checksum);
+}
+
+int main(int argc, char* argv[]) {
+    long iterations = (argc > 1) ? atol(argv[1]) : 1000000;
+
+    run("whole request", iterations, 0);
+    run("64-byte reads", iterations, 64);
+    run("8-byte reads", iterations / 4, 8);
+
+    char path[4096];
+    const char* raw = "/images/photo%20of%20campus%2Ejpg?size=large";
+    struct http_str target = { raw, (int) strlen(raw) };
+    double start = now();
+    int checksum = 0;
+    for (long it = 0; it < iterations; it++)
+        checksum += http_decode_path(target, path, sizeof(path));
+    double elapsed = now() - start;
+    printf("%-24s %12.0f paths/s  (checksum %d)\n", "percent-decoding", iterations / elapsed, checksum);
+    return 0;
+}
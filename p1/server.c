@@ -1,39 +1,841 @@
+#define _GNU_SOURCE // memmem(), accept4(), sched_setaffinity()
 #include <stdio.h>
 #include <sys/types.h>   // definitions of a number of data types used in socket.h and netinet/in.h
 #include <sys/socket.h>  // definitions of structures needed for sockets, e.g. sockaddr
 #include <netinet/in.h>  // constants and structures needed for internet domain addresses, e.g. sockaddr_in
 #include <unistd.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <time.h>
 #include <signal.h>  /* signal name macros, and the kill() prototype */
 
 #include <sys/sendfile.h>
 #include <sys/stat.h>
-#include <math.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "file_cache.h"
+#include "fd_cache.h"
+#include "http_parser.h"
+
+// Compile with -DUSE_SENDFILE=0 to make the buffered copy path the default.
+#ifndef USE_SENDFILE
+#define USE_SENDFILE 1
+#endif
+
+#define MAXREQLEN 8192   // Maximum size of an HTTP GET request.
+#define MAXPATHLEN 4096  // Maximum pathname length in Linux.
+#define MAXHEADLEN 512   // Status line + headers (+ inline error body).
+#define MAXEVENTS 256    // Events handled per epoll_wait() call.
+#define CACHE_MAX_FILE_SIZE (1 << 20) // Larger files are always sent straight from disk.
+#define MAX_RANGES 16    // More ranges than this in one request and we send the whole file.
+#define COMPRESS_MIN_SIZE 256 // Smaller files aren't worth gzipping on the fly.
+
+int use_sendfile = USE_SENDFILE; // Can be turned off at runtime with -c.
+int backlog = SOMAXCONN;         // Pending connection queue length, set with -l.
+int pin_workers = 0;             // Pin each worker process to its own CPU (-a).
+int idle_timeout = 5;            // Seconds a connection may sit without progress, set with -t.
+int max_requests = 100;          // Requests served per persistent connection, set with -k.
+size_t cache_size = 64 << 20;    // Bytes of hot file data kept in memory per process, set with -m (in MB).
+int fd_cache_size = 256;         // Descriptors of recently served files kept open, set with -f.
+int fd_cache_ttl = 1;            // Seconds before a cached descriptor is checked against the path, set with -T.
+
+volatile sig_atomic_t stats_requested = 0; // Set by SIGUSR1.
+
+// Where a connection is in the request/response cycle.
+enum conn_state {
+    CONN_READING_REQUEST,  // Waiting for the full request header to arrive.
+    CONN_SENDING_HEADERS,  // Writing the status line and headers.
+    CONN_SENDING_BODY      // Writing the file body.
+};
+
+// Content-codings we serve, in order of preference. A file "x.html" may come with
+// precompressed siblings "x.html.br" and "x.html.gz"; gzip is also done on the fly.
+struct coding {
+    const char* name;
+    const char* suffix;
+    const char* headers;
+};
+
+const struct coding codings[] = {
+    { "br", ".br", "Content-Encoding: br\nVary: Accept-Encoding\n" },
+    { "gzip", ".gz", "Content-Encoding: gzip\nVary: Accept-Encoding\n" },
+};
+
+#define NCODINGS (int) (sizeof(codings) / sizeof(codings[0]))
+#define GZIP (&codings[1])
+
+// Per-connection state, so a slow client only ever blocks itself.
+struct connection {
+    int fd;
+    enum conn_state state;
+
+    int request_len;   // Bytes buffered in request, may hold several pipelined requests.
+    int request_end;   // Length of the request currently being answered.
+    int head_len;
+    int head_sent;
+
+    int keepalive;     // Keep the connection open once this response is sent?
+    int head_only;     // HEAD request, send no body.
+    int requests_served;
+    int peer_closed;   // Client shut down its side, answer what we have and close.
+    time_t last_active;
+    struct connection* prev; // Connections, least recently active first, for idle timeouts.
+    struct connection* next;
+
+    struct cache_entry* entry; // Cached file being sent from memory, or NULL.
+    struct fd_entry* file;     // Open file being sent from disk, or NULL.
+    const struct coding* coding; // Content-Encoding of the body, NULL when sent as is.
+    int vary;          // Would another Accept-Encoding have got a different body?
+    int regular;       // Regular file? Only those can go through sendfile().
+    off_t offset;      // Next byte of the file (or cached data) to send.
+    off_t remaining;   // Body bytes left to send, or -1 to send until EOF.
+    char* copybuf;     // Buffered copy path only.
+    int copybuf_len;
+    int copybuf_sent;
+
+    // Range requests. With more than one range the body is multipart/byteranges and
+    // each part is sent as its own head (part headers) + body (file slice) segment.
+    int nranges;
+    int range_index;   // Range being sent; nranges once only the closing boundary is left.
+    off_t filesize;
+    const char* contenttype;
+    char boundary[24];
+    struct http_range ranges[MAX_RANGES];
+
+    // Buffers go last so conn_new() only has to clear the fields above.
+    char request[MAXREQLEN];
+    char head[MAXHEADLEN]; // Response headers, followed by the body for error pages.
+    struct http_request req; // Parsed view of the request currently being answered.
+    char filename[MAXPATHLEN];
+};
+
+struct connection* idle_head = NULL; // Least recently active connection.
+struct connection* idle_tail = NULL; // Most recently active connection.
 
 void error(char *msg) {
     perror(msg);
     exit(1);
 }
 
-int main(int argc, char *argv[])
-{
-    int sockfd, newsockfd, portno;
-    socklen_t clilen;
-    struct sockaddr_in serv_addr, cli_addr;
+time_t now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
 
-    if (argc < 2) {
-        fprintf(stderr,"ERROR, no port provided\n");
-        exit(1);
+void conn_unlink(struct connection* c) {
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        idle_head = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    else
+        idle_tail = c->prev;
+    c->prev = c->next = NULL;
+}
+
+// Record activity on c by moving it to the back of the idle list.
+void conn_touch(struct connection* c) {
+    c->last_active = now_seconds();
+    if (idle_tail == c)
+        return;
+    if (c->prev || c->next || idle_head == c)
+        conn_unlink(c);
+    c->prev = idle_tail;
+    if (idle_tail)
+        idle_tail->next = c;
+    else
+        idle_head = c;
+    idle_tail = c;
+}
+
+struct connection* conn_new(int fd) {
+    struct connection* c = malloc(sizeof(struct connection));
+    if (!c)
+        return NULL;
+    memset(c, 0, offsetof(struct connection, request));
+    c->fd = fd;
+    c->state = CONN_READING_REQUEST;
+    http_request_init(&c->req);
+    conn_touch(c);
+    return c;
+}
+
+void conn_close(struct connection* c) {
+    conn_unlink(c);
+    if (c->entry)
+        cache_release(c->entry);
+    if (c->file)
+        fd_cache_release(c->file);
+    free(c->copybuf);
+    close(c->fd); // Also removes it from the epoll set.
+    free(c);
+}
+
+// Close every connection that has not made progress for idle_timeout seconds.
+void close_idle_connections() {
+    time_t now = now_seconds();
+    while (idle_head && now - idle_head->last_active >= idle_timeout)
+        conn_close(idle_head);
+}
+
+// Whether a whole request (or a malformed one, which gets a 400) is buffered
+// behind the current one.
+int conn_has_next_request(struct connection* c) {
+    struct http_request next;
+    http_request_init(&next);
+    return http_parse(&next, c->request + c->request_end, c->request_len - c->request_end) != HTTP_PARSE_INCOMPLETE;
+}
+
+// Decide whether the connection survives the current request: HTTP/1.1 is persistent
+// unless the client says "Connection: close", HTTP/1.0 only with "Connection: keep-alive".
+// Once the client has shut down its side, only as long as it pipelined more requests.
+int wants_keepalive(struct connection* c) {
+    if (c->requests_served + 1 >= max_requests)
+        return 0;
+    if (c->peer_closed && !conn_has_next_request(c))
+        return 0;
+    if (http_str_has_token(c->req.connection, "close"))
+        return 0;
+    if (c->req.version_major == 1 && c->req.version_minor == 0)
+        return http_str_has_token(c->req.connection, "keep-alive");
+    return c->req.version_major == 1;
+}
+
+// Refuse paths that climb out of the directory we serve from.
+int path_is_safe(const char* path) {
+    for (const char* p = path; (p = strstr(p, "..")) != NULL; p += 2) {
+        if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/'))
+            return 0;
+    }
+    return 1;
+}
+
+// Map a file extension to its Content-Type.
+const char* content_type(const char* filetype) {
+    if (!strcmp(filetype, "html") || !strcmp(filetype, "htm")) {
+        return "text/html";
+    } else if (!strcmp(filetype, "jpg") || (!strcmp(filetype, "jpeg"))) {
+        return "image/jpeg";
+    } else if (!strcmp(filetype, "gif")) {
+        return "image/gif";
+    } else { // Just fallback to octet-stream (for binary files typically).
+        return "application/octet-stream";
+    }
+}
+
+// Content-Encoding and Vary headers for the body being sent, if any.
+const char* encoding_headers(struct connection* c) {
+    if (c->coding)
+        return c->coding->headers;
+    return c->vary ? "Vary: Accept-Encoding\n" : "";
+}
+
+// Fill in the response head for a request that can't be served from a file.
+void conn_error_response(struct connection* c, const char* status, const char* body) {
+    c->head_len = snprintf(c->head, MAXHEADLEN,
+                           "HTTP/1.1 %s\nContent-length: %d\nContent-Type: text/html\nConnection: %s\n\n%s",
+                           status, (int) strlen(body), c->keepalive ? "keep-alive" : "close", body);
+    c->remaining = 0;
+}
+
+// Write the header block preceding multipart range i (or the closing boundary
+// when i == nranges) into buf. Returns its length.
+int range_part_header(struct connection* c, int i, char* buf, int buflen) {
+    const char* sep = (i == 0) ? "" : "\r\n";
+    if (i == c->nranges)
+        return snprintf(buf, buflen, "\r\n--%s--\r\n", c->boundary);
+    return snprintf(buf, buflen, "%s--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+                    sep, c->boundary, c->contenttype, (long long) c->ranges[i].start,
+                    (long long) c->ranges[i].end, (long long) c->filesize);
+}
+
+// Answer a Range request for the open file or cache entry. Returns 0 if the Range
+// header should be ignored and the whole file sent instead.
+int conn_range_response(struct connection* c, off_t size, const char* contenttype) {
+    c->nranges = http_parse_ranges(c->req.range, size, c->ranges, MAX_RANGES);
+    if (c->nranges < 0) {
+        c->nranges = 0;
+        return 0;
+    }
+
+    const char* connection = c->keepalive ? "keep-alive" : "close";
+    c->filesize = size;
+    c->contenttype = contenttype;
+    c->range_index = 0;
+
+    if (c->nranges == 0) {
+        c->head_len = snprintf(c->head, MAXHEADLEN,
+                               "HTTP/1.1 416 Range Not Satisfiable\nContent-length: 0\nContent-Range: bytes */%lld\nConnection: %s\n\n",
+                               (long long) size, connection);
+        c->remaining = 0;
+        return 1;
+    }
+
+    if (c->nranges == 1) {
+        struct http_range* r = &c->ranges[0];
+        c->head_len = snprintf(c->head, MAXHEADLEN,
+                               "HTTP/1.1 206 Partial Content\nContent-length: %lld\nContent-Type: %s\n%sContent-Range: bytes %lld-%lld/%lld\nAccept-Ranges: bytes\nConnection: %s\n\n",
+                               (long long) (r->end - r->start + 1), contenttype, encoding_headers(c),
+                               (long long) r->start, (long long) r->end, (long long) size, connection);
+        c->offset = r->start;
+        c->remaining = r->end - r->start + 1;
+        return 1;
+    }
+
+    // multipart/byteranges: work out the total length up front so keep-alive still works.
+    static unsigned int responses = 0;
+    snprintf(c->boundary, sizeof(c->boundary), "%08x%08x", (unsigned int) getpid(), ++responses);
+    char part[MAXHEADLEN];
+    long long length = 0;
+    for (int i = 0; i <= c->nranges; i++) {
+        length += range_part_header(c, i, part, sizeof(part));
+        if (i < c->nranges)
+            length += c->ranges[i].end - c->ranges[i].start + 1;
+    }
+
+    c->head_len = snprintf(c->head, MAXHEADLEN,
+                           "HTTP/1.1 206 Partial Content\nContent-length: %lld\nContent-Type: multipart/byteranges; boundary=%s\n%sAccept-Ranges: bytes\nConnection: %s\n\n",
+                           length, c->boundary, encoding_headers(c), connection);
+    c->head_len += range_part_header(c, 0, c->head + c->head_len, MAXHEADLEN - c->head_len);
+    c->offset = c->ranges[0].start;
+    c->remaining = c->ranges[0].end - c->ranges[0].start + 1;
+    return 1;
+}
+
+// Move on to the next part of a multipart/byteranges response. Returns 0 once
+// everything, including the closing boundary, has been sent.
+int conn_next_range(struct connection* c) {
+    if (c->nranges < 2 || c->range_index == c->nranges)
+        return 0;
+
+    int i = ++c->range_index;
+    c->state = CONN_SENDING_HEADERS;
+    c->head_sent = 0;
+    c->head_len = range_part_header(c, i, c->head, MAXHEADLEN);
+    c->copybuf_len = c->copybuf_sent = 0;
+    if (i < c->nranges) {
+        c->offset = c->ranges[i].start;
+        c->remaining = c->ranges[i].end - c->ranges[i].start + 1;
+    } else {
+        c->remaining = 0;
+    }
+    return 1;
+}
+
+// Can the client's copy be reused? If-None-Match takes precedence over If-Modified-Since.
+int request_not_modified(struct connection* c, const char* etag, time_t mtime) {
+    if (c->req.if_none_match.p)
+        return http_etag_list_matches(c->req.if_none_match, etag);
+
+    time_t since;
+    if (c->req.if_modified_since.p && http_parse_date(c->req.if_modified_since, &since) == 0)
+        return mtime <= since;
+    return 0;
+}
+
+// If-Range: only honour Range if the client's copy is still current. Entity tags
+// must match exactly (strong comparison), dates to the second.
+int request_if_range_matches(struct connection* c, const char* etag, time_t mtime) {
+    struct http_str v = c->req.if_range;
+    if (!v.p)
+        return 1;
+    if (v.len > 0 && v.p[0] == '"')
+        return v.len == (int) strlen(etag) && !memcmp(v.p, etag, v.len);
+
+    time_t date;
+    return http_parse_date(v, &date) == 0 && date == mtime;
+}
+
+// Handle conditional and Range requests for a regular file. Returns 1 if the
+// response head was written, 0 if a plain 200 should be sent.
+int conn_conditional_response(struct connection* c, off_t size, const char* contenttype,
+                              const char* etag, const char* lastmodified, time_t mtime) {
+    if (request_not_modified(c, etag, mtime)) {
+        c->head_len = snprintf(c->head, MAXHEADLEN,
+                               "HTTP/1.1 304 Not Modified\nETag: %s\nLast-Modified: %s\n%sConnection: %s\n\n",
+                               etag, lastmodified, c->vary ? "Vary: Accept-Encoding\n" : "",
+                               c->keepalive ? "keep-alive" : "close");
+        c->remaining = 0;
+        return 1;
+    }
+
+    return c->req.range.p && !c->head_only && request_if_range_matches(c, etag, mtime)
+        && conn_range_response(c, size, contenttype);
+}
+
+// Answer from c->entry: its pre-rendered headers plus our Connection header.
+void conn_cached_response(struct connection* c) {
+    struct cache_entry* e = c->entry;
+    if (conn_conditional_response(c, e->size, e->content_type, e->etag, e->last_modified, e->mtime.tv_sec))
+        return;
+
+    memcpy(c->head, e->head, e->head_len);
+    c->head_len = e->head_len;
+    c->head_len += snprintf(c->head + c->head_len, MAXHEADLEN - c->head_len, "Connection: %s\n\n",
+                            c->keepalive ? "keep-alive" : "close");
+    c->offset = 0;
+    c->remaining = c->head_only ? 0 : e->size;
+}
+
+// Pick a Content-Encoding for the compressible file open on c->file. A precompressed
+// sibling the client accepts wins, as long as it isn't older than the file itself:
+// c->file and *st then describe the sibling. Failing that, gzip the file into the
+// hot-file cache (or find it there already), leaving c->entry set.
+void conn_negotiate_encoding(struct connection* c, const char* filename, struct stat* st) {
+    char sibling[MAXPATHLEN];
+    for (int i = 0; i < NCODINGS; i++) {
+        const struct coding* coding = &codings[i];
+        if (!http_accepts_encoding(c->req.accept_encoding, coding->name)
+            || snprintf(sibling, MAXPATHLEN, "%s%s", filename, coding->suffix) >= MAXPATHLEN)
+            continue;
+
+        // Missing siblings are remembered by the fd cache, so this costs no syscall.
+        struct fd_entry* f = fd_cache_open(sibling);
+        if (!f)
+            continue;
+        if (!S_ISREG(f->st.st_mode) || f->st.st_mtim.tv_sec < st->st_mtim.tv_sec
+            || (f->st.st_mtim.tv_sec == st->st_mtim.tv_sec && f->st.st_mtim.tv_nsec < st->st_mtim.tv_nsec)) {
+            fd_cache_release(f);
+            continue;
+        }
+        fd_cache_release(c->file);
+        c->file = f;
+        *st = f->st;
+        c->coding = coding;
+        return;
+    }
+
+    if (cache_size == 0 || st->st_size < COMPRESS_MIN_SIZE || !http_accepts_encoding(c->req.accept_encoding, GZIP->name))
+        return;
+    if ((c->entry = cache_lookup(filename, GZIP->name, st)) != NULL
+        || (c->entry = cache_insert(filename, GZIP->name, c->file->fd, st, c->contenttype, 1)) != NULL) {
+        fd_cache_release(c->file);
+        c->file = NULL;
+        c->coding = GZIP;
+    }
+}
+
+// Parse the buffered request, open the requested file and build the response head.
+void conn_prepare_response(struct connection* c) {
+    fprintf(stdout, "%.*s", c->request_end, c->request);
+
+    c->state = CONN_SENDING_HEADERS;
+    c->head_sent = 0;
+    c->keepalive = wants_keepalive(c);
+
+    // Only GET and HEAD make sense for static files.
+    c->head_only = http_str_eq(c->req.method, "HEAD");
+    if (!c->head_only && !http_str_eq(c->req.method, "GET")) {
+        conn_error_response(c, "501 Not Implemented", "<b>501 Not Implemented</b>");
+        return;
+    }
+
+    // Process HTTP request: the decoded path, without its leading slash, names a file
+    // relative to the directory we were started in.
+    char decoded[MAXPATHLEN];
+    if (http_decode_path(c->req.target, decoded, MAXPATHLEN) <= 0 || decoded[0] != '/' || !path_is_safe(decoded)) {
+        c->keepalive = 0;
+        conn_error_response(c, "400 Bad Request", "<b>400 Bad Request</b>");
+        return;
+    }
+    char* filename = c->filename;
+    strcpy(filename, decoded + 1);
+
+    // File type is whatever follows the last '.' of the last path component.
+    const char* filetype = strrchr(filename, '.');
+    filetype = (filetype && !strchr(filetype, '/')) ? filetype + 1 : "";
+
+    // Open file. Recently served files come out of the fd cache with their stat data.
+    c->file = fd_cache_open(filename);
+    if (!c->file || S_ISDIR(c->file->st.st_mode)) {
+        if (c->file) {
+            fd_cache_release(c->file);
+            c->file = NULL;
+        }
+        // Send HTTP 404 response.
+        conn_error_response(c, "404 Not Found", "<b>404 Not Found</b>");
+        return;
+    }
+    struct stat st = c->file->st;
+
+    // Send correct filetype.
+    const char* contenttype = content_type(filetype);
+    c->contenttype = contenttype;
+
+    c->coding = NULL;
+    c->vary = S_ISREG(st.st_mode) && content_compressible(contenttype);
+    if (c->vary && c->req.accept_encoding.p) {
+        conn_negotiate_encoding(c, filename, &st);
+        if (c->entry) {
+            conn_cached_response(c);
+            return;
+        }
+    }
+
+    // Determine file length and include it in the HTTP response.
+    c->regular = S_ISREG(st.st_mode);
+    c->offset = 0;
+    c->remaining = c->regular ? st.st_size : -1;
+    if (!c->regular)
+        c->keepalive = 0; // Body length is unknown, the client reads until we close.
+
+    // Serve hot files straight from memory, as long as they haven't changed on disk.
+    const char* encoding = c->coding ? c->coding->name : "";
+    if (cache_size > 0 && c->regular
+        && ((c->entry = cache_lookup(filename, encoding, &st)) != NULL
+            || (c->entry = cache_insert(filename, encoding, c->file->fd, &st, contenttype, 0)) != NULL)) {
+        fd_cache_release(c->file);
+        c->file = NULL;
+        conn_cached_response(c);
+        return;
+    }
+
+    if (!c->regular) {
+        // No Content-length: the body ends when we close.
+        c->head_len = snprintf(c->head, MAXHEADLEN, "HTTP/1.1 200 OK\nContent-Type: %s\nConnection: close\n\n", contenttype);
+        if (c->head_only) {
+            fd_cache_release(c->file);
+            c->file = NULL;
+        }
+        return;
+    }
+
+    char etag[HTTP_ETAG_LEN], lastmodified[HTTP_DATE_LEN];
+    http_format_etag(&st, c->coding ? c->coding->name : NULL, etag, HTTP_ETAG_LEN);
+    http_format_date(st.st_mtime, lastmodified, HTTP_DATE_LEN);
+    if (conn_conditional_response(c, st.st_size, contenttype, etag, lastmodified, st.st_mtime))
+        return;
+
+    c->head_len = snprintf(c->head, MAXHEADLEN,
+                           "HTTP/1.1 200 OK\nContent-length: %lld\nContent-Type: %s\n%sETag: %s\nLast-Modified: %s\nAccept-Ranges: bytes\nConnection: %s\n\n",
+                           (long long) st.st_size, contenttype, encoding_headers(c), etag, lastmodified,
+                           c->keepalive ? "keep-alive" : "close");
+
+    if (c->head_only) {
+        fd_cache_release(c->file);
+        c->file = NULL;
+    }
+}
+
+// Read whatever the client has sent (edge-triggered, so until EAGAIN or the buffer
+// is full) and start answering the first complete request in the buffer.
+// Returns -1 if the connection should be dropped.
+int conn_read(struct connection* c) {
+    while (c->request_len < MAXREQLEN && !c->peer_closed) {
+        ssize_t n = read(c->fd, c->request + c->request_len, MAXREQLEN - c->request_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        if (n == 0) { // Client closed its side, answer whatever complete requests it sent.
+            c->peer_closed = 1;
+            break;
+        }
+        c->request_len += n;
+    }
+
+    // Only the bytes that arrived since the last call get parsed.
+    int status = http_parse(&c->req, c->request, c->request_len);
+    if (status == HTTP_PARSE_DONE) {
+        c->request_end = c->req.length;
+        conn_prepare_response(c);
+    } else if (status == HTTP_PARSE_ERROR || c->request_len == MAXREQLEN) {
+        c->state = CONN_SENDING_HEADERS;
+        c->head_sent = 0;
+        c->keepalive = 0;
+        conn_error_response(c, "400 Bad Request", "<b>400 Bad Request</b>");
+    } else if (c->peer_closed) {
+        return -1;
+    }
+    return 0;
+}
+
+// Drop the request we just answered from the buffer, keeping any pipelined
+// requests behind it, and get ready to answer the next one.
+void conn_next_request(struct connection* c) {
+    if (c->entry) {
+        cache_release(c->entry);
+        c->entry = NULL;
+    }
+    if (c->file) {
+        fd_cache_release(c->file);
+        c->file = NULL;
     }
+    c->request_len -= c->request_end;
+    memmove(c->request, c->request + c->request_end, c->request_len);
+    c->request_end = 0;
+    c->nranges = 0;
+    http_request_init(&c->req);
+    c->requests_served++;
+    c->copybuf_len = c->copybuf_sent = 0;
+    c->state = CONN_READING_REQUEST;
+}
+
+// Push the file body out, zero-copy when possible. Returns 1 when done, 0 if the
+// socket is full, -1 on error.
+int conn_send_body(struct connection* c) {
+    if (use_sendfile && c->regular) {
+        while (c->remaining > 0) {
+            ssize_t n = sendfile(c->fd, c->file->fd, &c->offset, c->remaining); // offset is advanced by sendfile.
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+                return -1;
+            }
+            if (n == 0) // File was truncated underneath us.
+                return -1;
+            c->remaining -= n;
+        }
+        return 1;
+    }
+
+    // Buffered copy through an 8 KB buffer. Works on any readable file (pipes, character devices, ...).
+    if (!c->copybuf && !(c->copybuf = malloc(8192)))
+        return -1;
+    while (c->remaining != 0) {
+        if (c->copybuf_sent == c->copybuf_len) {
+            size_t want = (c->remaining > 0 && c->remaining < 8192) ? c->remaining : 8192;
+            // Cached descriptors are shared between connections, so never move their file position.
+            ssize_t count = c->regular ? pread(c->file->fd, c->copybuf, want, c->offset)
+                                       : read(c->file->fd, c->copybuf, want);
+            if (count < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (count == 0) // EOF.
+                return (c->remaining > 0) ? -1 : 1;
+            c->copybuf_len = count;
+            c->copybuf_sent = 0;
+            c->offset += count;
+        }
+        ssize_t n = send(c->fd, c->copybuf + c->copybuf_sent, c->copybuf_len - c->copybuf_sent, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        c->copybuf_sent += n;
+        if (c->remaining > 0)
+            c->remaining -= n;
+    }
+    return 1;
+}
+
+// Send the head and the cached body together with writev(). Returns 1 when done,
+// 0 if the socket is full, -1 on error.
+int conn_send_cached(struct connection* c) {
+    while (c->head_sent < c->head_len || c->remaining > 0) {
+        struct iovec iov[2];
+        int iovcnt = 0;
+        if (c->head_sent < c->head_len) {
+            iov[iovcnt].iov_base = c->head + c->head_sent;
+            iov[iovcnt++].iov_len = c->head_len - c->head_sent;
+        }
+        if (c->remaining > 0) {
+            iov[iovcnt].iov_base = c->entry->data + c->offset;
+            iov[iovcnt++].iov_len = c->remaining;
+        }
+
+        ssize_t n = writev(c->fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+
+        int headpart = c->head_len - c->head_sent;
+        if (n < headpart)
+            headpart = n;
+        c->head_sent += headpart;
+        c->offset += n - headpart;
+        c->remaining -= n - headpart;
+    }
+    c->state = CONN_SENDING_BODY;
+    return 1;
+}
+
+// Send the current head + body segment. Returns 1 when it is complete, 0 if we
+// have to wait for EPOLLOUT, -1 on error.
+int conn_write_segment(struct connection* c) {
+    if (c->entry)
+        return conn_send_cached(c);
+
+    if (c->state == CONN_SENDING_HEADERS) {
+        while (c->head_sent < c->head_len) {
+            ssize_t n = send(c->fd, c->head + c->head_sent, c->head_len - c->head_sent, 0);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return 0;
+                return -1;
+            }
+            c->head_sent += n;
+        }
+        c->state = CONN_SENDING_BODY;
+    }
+
+    if (!c->file)
+        return 1; // Error page, body was sent with the head.
+
+    return conn_send_body(c);
+}
+
+// Send as much of the response as the socket will take. Returns 1 when the
+// response is complete, 0 if we have to wait for EPOLLOUT, -1 on error.
+int conn_write(struct connection* c) {
+    int status;
+    while ((status = conn_write_segment(c)) > 0 && conn_next_range(c))
+        ;
+
+    if (status < 0) {
+        perror("ERROR sending file"); // Most likely the client went away, keep serving others.
+    } else if (status > 0 && (c->file || c->entry)) {
+        fprintf(stderr, "Successfully sent file %s\n", c->filename);
+    }
+    return status;
+}
+
+// Accept every pending connection and register it with the event loop.
+void accept_connections(int epollfd, int sockfd) {
+    while (1) {
+        struct sockaddr_in cli_addr;
+        socklen_t clilen = sizeof(cli_addr);
+        int newsockfd = accept4(sockfd, (struct sockaddr *) &cli_addr, &clilen, SOCK_NONBLOCK);
+        if (newsockfd < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("ERROR on accept"); // e.g. out of file descriptors, retry on the next event.
+            return;
+        }
+
+        struct connection* c = conn_new(newsockfd);
+        if (!c) {
+            close(newsockfd);
+            continue;
+        }
+
+        // Edge-triggered: we are only told about new data/space, so handlers run until EAGAIN.
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, newsockfd, &ev) < 0) {
+            perror("ERROR on epoll_ctl");
+            conn_close(c);
+        }
+    }
+}
+
+// Drive a connection as far as it can go without blocking, answering pipelined
+// requests back to back. Returns -1 once the connection should be closed.
+int conn_run(struct connection* c) {
+    while (1) {
+        if (c->state == CONN_READING_REQUEST) {
+            if (conn_read(c) < 0)
+                return -1;
+            if (c->state == CONN_READING_REQUEST)
+                return 0; // Wait for the rest of the request.
+        }
+
+        int status = conn_write(c);
+        if (status <= 0)
+            return status; // Wait for EPOLLOUT, or failed.
+
+        if (!c->keepalive)
+            return -1;
+        conn_next_request(c);
+    }
+}
 
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);  // create socket
+// Event loop. Multiplexes every client connection on this thread.
+void serve(int sockfd) {
+    cache_init(cache_size, CACHE_MAX_FILE_SIZE);
+    fd_cache_init(fd_cache_size, fd_cache_ttl);
+
+    int epollfd = epoll_create1(0);
+    if (epollfd < 0)
+        error("ERROR creating epoll instance");
+
+    struct epoll_event ev, events[MAXEVENTS];
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL; // NULL marks the listening socket.
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &ev) < 0)
+        error("ERROR on epoll_ctl");
+
+    while (1) {
+        int n = epoll_wait(epollfd, events, MAXEVENTS, 1000); // Wake up at least once a second for idle checks.
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            error("ERROR on epoll_wait");
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct connection* c = events[i].data.ptr;
+            if (c == NULL) {
+                accept_connections(epollfd, sockfd);
+                continue;
+            }
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                conn_close(c);
+                continue;
+            }
+
+            conn_touch(c);
+            if (conn_run(c) < 0)
+                conn_close(c);  // Done with this client (or it failed), close connection.
+        }
+
+        close_idle_connections();
+
+        if (stats_requested) {
+            stats_requested = 0;
+            fprintf(stderr, "[%d] ", (int) getpid());
+            cache_print_stats(stderr);
+            fprintf(stderr, "[%d] ", (int) getpid());
+            fd_cache_print_stats(stderr);
+        }
+    }
+}
+
+// Create a non-blocking socket listening on portno. With reuseport, several
+// sockets can bind the same port and the kernel spreads new connections across them.
+int open_listener(int portno, int reuseport) {
+    int sockfd;
+    struct sockaddr_in serv_addr;
+
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);  // create socket
     if (sockfd < 0)
         error("ERROR opening socket");
     memset((char *) &serv_addr, 0, sizeof(serv_addr));   // reset memory
 
+    int reuse = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)); // Allow quick restarts.
+    if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+        error("ERROR setting SO_REUSEPORT");
+
     // fill in address info
-    portno = atoi(argv[1]);
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = INADDR_ANY;
     serv_addr.sin_port = htons(portno);
@@ -41,117 +843,138 @@ int main(int argc, char *argv[])
     if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
         error("ERROR on binding");
 
-    listen(sockfd, 5);  // 5 simultaneous connection at most
+    if (listen(sockfd, backlog) < 0)
+        error("ERROR on listen");
 
-    while (1) {
-        // Accept connections.
-        newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
-
-        if (newsockfd < 0)
-        error("ERROR on accept");
-
-        int n;
-        const int maxreqlen = 8192;
-        char request[maxreqlen]; // Maximum size of an HTTP GET request.
-        memset(request, 0, maxreqlen);  // reset memory
-
-        // Read client's message.
-        n = read(newsockfd, request, maxreqlen);
-        if (n < 0) 
-            error("ERROR reading from socket");
-        fprintf(stdout, "%s", request);
-
-        // Process HTTP request.
-        char filename[4096]; // Maximum pathname length in Linux.
-        memset(filename, 0, 4096);
-        int filename_index = 0;
-
-        char filetype[10]; // .html, .htm, .jpeg, .gif, or .jpg
-        memset(filetype, 0, 10);
-        int filetype_index = 0;
-        int filetype_flag = 0; // Are we currently processing the file type?
-
-        // Generate filename + filetype.
-        int i = 5;
-        while (i < 4096) {
-            if (request[i] == ' ') {
-                break;
-            }
+    return sockfd;
+}
 
-            if (request[i] == '.') {
-                filetype_flag = 1;
-            } else if (filetype_flag) {
-                filetype[filetype_index++] = request[i];
-            }
-            
-            if (strncmp(&request[i], "%20", 3) == 0) { // Check for whitespace code in pathname (represented as %20).
-                filename[filename_index++] = ' ';
-                i += 2;
-            } else {
-                filename[filename_index++] = request[i];
-            }
+// Body of worker process number id: own listener, own event loop.
+void run_worker(int id, int portno) {
+    if (pin_workers) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(id % (ncpus > 0 ? ncpus : 1), &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+            perror("ERROR pinning worker"); // Not fatal, the worker just floats.
+    }
 
-            i++;
-        }
-        filename[filename_index++] = '\0';
-        filetype[filetype_index++] = '\0';
- 
-        // Open file.
-        FILE* file = fopen(filename, "r");
-        if (!file) {
-            // Send HTTP 404 response.
-            write(newsockfd, "HTTP/1.1 404 Not Found\n", 14);
-            write(newsockfd, "Content-length: 13\n", 19);
-            write(newsockfd, "Content-Type: text/html\n\n", 25);
+    int sockfd = open_listener(portno, 1);
+    serve(sockfd);
+    close(sockfd);
+    exit(0);
+}
 
-            write(newsockfd, "<b>404 Not Found</b>", 20);
+pid_t spawn_worker(int id, int portno) {
+    pid_t pid = fork();
+    if (pid < 0)
+        error("ERROR forking worker");
+    if (pid == 0) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        run_worker(id, portno);
+    }
+    return pid;
+}
 
-            close(newsockfd);
-            continue;
-        }
+volatile sig_atomic_t shutting_down = 0;
+
+void handle_shutdown(int sig) {
+    shutting_down = 1;
+}
 
-        // Determine file length and include it in the HTTP response.
-        struct stat st;
-        stat(filename, &st);
-        int filesize = st.st_size;
+void handle_stats(int sig) {
+    stats_requested = 1;
+}
 
-        int contentstrlength = (int) (20 + ((ceil(log10(filesize)) + 1) * sizeof(char)));
-        char* contentstr = malloc(contentstrlength * sizeof(char));
-        sprintf(contentstr, "Content-length: %d\n", filesize);
+// Fork nworkers workers and keep them alive until we are told to stop.
+void run_workers(int nworkers, int portno) {
+    pid_t* workers = calloc(nworkers, sizeof(pid_t));
+    if (!workers)
+        error("ERROR allocating workers");
 
-        // Send HTTP response.
-        write(newsockfd, "HTTP/1.1 200 OK\n", 16);
-        write(newsockfd, contentstr, contentstrlength);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_shutdown; // No SA_RESTART, so waitpid() returns on signal.
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = handle_stats;
+    sigaction(SIGUSR1, &sa, NULL);
 
-        // Send correct filetype.
-        if (!strcmp(filetype, "html") || !strcmp(filetype, "htm")) {
-            write(newsockfd, "Content-Type: text/html\n\n", 25);
-        } else if (!strcmp(filetype, "jpg") || (!strcmp(filetype, "jpeg"))) {
-            write(newsockfd, "Content-Type: image/jpeg\n\n", 26);
-        } else if (!strcmp(filetype, "gif")) {
-            write(newsockfd, "Content-Type: image/gif\n\n", 25);
-        } else { // Just fallback to octet-stream (for binary files typically).
-            write(newsockfd, "Content-Type: application/octet-stream\n\n", 40);
-        }
+    for (int i = 0; i < nworkers; i++)
+        workers[i] = spawn_worker(i, portno);
 
-        int count;
-        int filefd = fileno(file);
-        char filebuffer[8192];
-        while ((count = read(filefd, filebuffer, sizeof filebuffer)) > 0) {
-            send(newsockfd, filebuffer, count, 0);
+    while (!shutting_down) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno != EINTR)
+                break;
+            if (stats_requested) { // Pass SIGUSR1 on, each worker has its own cache.
+                stats_requested = 0;
+                for (int i = 0; i < nworkers; i++)
+                    kill(workers[i], SIGUSR1);
+            }
+            continue;
+        }
+        // A worker died (it should never exit on its own). Replace it.
+        for (int i = 0; i < nworkers; i++) {
+            if (workers[i] == pid && !shutting_down) {
+                fprintf(stderr, "Worker %d exited, restarting it\n", i);
+                workers[i] = spawn_worker(i, portno);
+            }
         }
-        if (count < 0) {
-            error("ERROR sending file");
+    }
+
+    for (int i = 0; i < nworkers; i++)
+        kill(workers[i], SIGTERM);
+    while (waitpid(-1, NULL, 0) > 0)
+        ;
+    free(workers);
+}
+
+int main(int argc, char *argv[])
+{
+    int sockfd, portno;
+    int nworkers = 0; // 0 means serve from this process.
+
+    int opt;
+    while ((opt = getopt(argc, argv, "czl:w:at:k:m:f:T:")) != -1) {
+        switch (opt) {
+            case 'c': use_sendfile = 0; break; // Force buffered copy of file bodies.
+            case 'z': use_sendfile = 1; break; // Force zero-copy sendfile() of file bodies.
+            case 'l': backlog = atoi(optarg); break;
+            case 'w': nworkers = atoi(optarg); break; // One SO_REUSEPORT listener + event loop per worker.
+            case 'a': pin_workers = 1; break; // Pin worker i to CPU i.
+            case 't': idle_timeout = atoi(optarg); break;
+            case 'k': max_requests = atoi(optarg); break; // 1 disables keep-alive.
+            case 'm': cache_size = (size_t) atoi(optarg) << 20; break; // 0 disables the cache.
+            case 'f': fd_cache_size = atoi(optarg); break; // 0 disables the fd cache.
+            case 'T': fd_cache_ttl = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-c | -z] [-l backlog] [-w workers [-a]] [-t idle_timeout] [-k max_requests] [-m cache_mb] [-f fd_cache_size] [-T fd_cache_ttl] <port>\n", argv[0]);
+                exit(1);
         }
+    }
+
+    if (optind >= argc) {
+        fprintf(stderr,"ERROR, no port provided\n");
+        exit(1);
+    }
+
+    signal(SIGPIPE, SIG_IGN); // A client hanging up mid-transfer should not kill the server.
+    signal(SIGUSR1, handle_stats); // Dump cache counters.
 
-        fprintf(stderr, "Successfully sent file %s\n", filename);
-        // if (sendfile(newsockfd, fileno(file), NULL, 0) < 0) {
-        //     error("ERROR sending file");
-        // }
+    portno = atoi(argv[optind]);
 
-        close(newsockfd);  // close connection
+    if (nworkers > 0) {
+        run_workers(nworkers, portno);
+        return 0;
     }
 
+    sockfd = open_listener(portno, 0);
+    serve(sockfd);
     close(sockfd);
 
     return 0;
@@ -2,10 +2,36 @@
 
 int main(int argc, char* argv[])
 {
-    if (argc < 3) {
-        fprintf(stderr, "Must provide hostname, port number, and filename. Usage: %s <server_hostname> <server_portnumber> <filename>\n", argv[0]);
+    RdtOptions options;
+    int opt;
+    while ((opt = getopt(argc, argv, "ngdm:a:")) != -1) {
+        switch (opt) {
+            case 'n': options.batch_io = false; break; // One syscall per datagram.
+            case 'g': options.gso = false; break;      // Batch, but without UDP GSO.
+            case 'd': options.direct_io = true; break; // O_DIRECT and preallocation, for very large files.
+            case 'm':                                  // Cap the packet size offered in the handshake.
+                options.max_pkt_size = atoi(optarg);
+                if (options.max_pkt_size < MIN_PKT_SIZE || options.max_pkt_size > MAX_PKT_SIZE) {
+                    fprintf(stderr, "Packet size must be between %d and %d bytes.\n", MIN_PKT_SIZE, MAX_PKT_SIZE);
+                    exit(1);
+                }
+                break;
+            case 'a':                                  // ACK every this many in-order packets (1: all of them).
+                options.ack_every = atoi(optarg);
+                if (options.ack_every < 1) {
+                    fprintf(stderr, "Must ACK at least every packet.\n");
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n] [-g] [-d] [-m packet_size] [-a ack_every] <server_hostname> <server_portnumber> <filename>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (argc - optind < 3) {
+        fprintf(stderr, "Must provide hostname, port number, and filename. Usage: %s [-n] [-g] [-d] [-m packet_size] [-a ack_every] <server_hostname> <server_portnumber> <filename>\n", argv[0]);
         exit(1);
     }
 
-    new Client(argv[1], argv[2], argv[3]);
+    new Client(argv[optind], argv[optind + 1], argv[optind + 2], options);
 }
\ No newline at end of file
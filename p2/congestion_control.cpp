@@ -0,0 +1,291 @@
+#include "congestion_control.h"
+
+#include <math.h>
+#include <string.h>
+#include <algorithm>
+
+using namespace std;
+
+CongestionControl* CongestionControl::create(const char* name, uint32_t mss, uint32_t initial_window, uint32_t initial_ssthresh) {
+    if (strcmp(name, "reno") == 0) {
+        return new Reno(mss, initial_window, initial_ssthresh);
+    }
+    if (strcmp(name, "cubic") == 0) {
+        return new Cubic(mss, initial_window, initial_ssthresh);
+    }
+    if (strcmp(name, "bbr") == 0) {
+        return new Bbr(mss, initial_window);
+    }
+    return NULL;
+}
+
+// Reno.
+
+Reno::Reno(uint32_t mss, uint32_t initial_window, uint32_t initial_ssthresh) {
+    this->mss = mss;
+    this->window = initial_window * mss;
+    this->threshold = initial_ssthresh * mss;
+}
+
+void Reno::onAck(uint32_t acked, int64_t rtt, uint32_t inflight, int64_t now) {
+    if (this->recovery) {
+        // The loss has been repaired: deflate the window to what it was cut to.
+        this->window = this->threshold;
+        this->recovery = false;
+        return;
+    }
+    if (this->window < this->threshold) {
+        // Slow start. Grow by the bytes ACKed, not per ACK, since the client may
+        // ACK several packets at once (RFC 3465, with L = 2 packets).
+        this->window += min(acked, 2 * this->mss);
+    } else {
+        // Congestion avoidance: one packet per window's worth of ACKed bytes.
+        this->ca_acked += acked;
+        if (this->ca_acked >= this->window) {
+            this->ca_acked -= this->window;
+            this->window += this->mss;
+        }
+    }
+}
+
+void Reno::onDupAck() {
+    if (this->recovery) {
+        this->window += this->mss; // Another packet has left the network.
+    }
+}
+
+void Reno::onLoss(int64_t now) {
+    this->threshold = max(this->window / 2, 2 * this->mss);
+    this->window = this->threshold + 3 * this->mss;
+    this->ca_acked = 0;
+    this->recovery = true;
+}
+
+void Reno::onTimeout(int64_t now) {
+    this->threshold = max(this->window / 2, 2 * this->mss);
+    this->window = this->mss;
+    this->ca_acked = 0;
+    this->recovery = false;
+}
+
+// CUBIC.
+
+const double CUBIC_C = 0.4;    // Scales the cubic (packets/s^3).
+const double CUBIC_BETA = 0.7; // Window kept on loss.
+
+Cubic::Cubic(uint32_t mss, uint32_t initial_window, uint32_t initial_ssthresh) {
+    this->mss = mss;
+    this->window = initial_window;
+    this->threshold = initial_ssthresh;
+}
+
+void Cubic::onAck(uint32_t acked, int64_t rtt, uint32_t inflight, int64_t now) {
+    if (rtt > 0 && (this->min_rtt == 0 || rtt < this->min_rtt)) {
+        this->min_rtt = rtt;
+    }
+    double segments = (double) acked / this->mss;
+    if (this->window < this->threshold) {
+        this->window += min(segments, 2.0); // Slow start, as in Reno.
+        return;
+    }
+
+    if (this->epoch_start == 0) {
+        // First ACK since the last reduction: the cubic starts here, reaching w_max after k seconds.
+        this->epoch_start = now;
+        if (this->window < this->w_max) {
+            this->k = cbrt((this->w_max - this->window) / CUBIC_C);
+        } else {
+            this->k = 0;
+            this->w_max = this->window;
+        }
+        this->w_est = this->window;
+    }
+
+    // Aim for where the cubic will be one RTT from now, growing by at most half
+    // the window per RTT.
+    double t = (now - this->epoch_start + this->min_rtt) / 1e6;
+    double target = CUBIC_C * pow(t - this->k, 3) + this->w_max;
+    target = min(max(target, this->window), 1.5 * this->window);
+    this->window += (target - this->window) / this->window * segments;
+
+    // Reno-friendly region: never grow slower than Reno with the same decrease would.
+    this->w_est += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * segments / this->window;
+    if (this->w_est > this->window) {
+        this->window = this->w_est;
+    }
+}
+
+void Cubic::reduce() {
+    // Fast convergence: a flow whose window keeps shrinking releases bandwidth
+    // sooner by aiming below where it lost.
+    this->w_max = (this->window < this->w_max)? this->window * (1 + CUBIC_BETA) / 2 : this->window;
+    this->threshold = max(this->window * CUBIC_BETA, 2.0);
+    this->epoch_start = 0;
+}
+
+void Cubic::onLoss(int64_t now) {
+    this->reduce();
+    this->window = this->threshold;
+}
+
+void Cubic::onTimeout(int64_t now) {
+    this->reduce();
+    this->window = 1;
+}
+
+// BBR.
+
+const double BBR_HIGH_GAIN = 2.885; // 2/ln(2): doubles the delivery rate every round.
+const double BBR_CYCLE[] = {1.25, 0.75, 1, 1, 1, 1, 1, 1}; // PROBE_BW pacing gains, a round each.
+const int BBR_CYCLE_LENGTH = sizeof(BBR_CYCLE) / sizeof(BBR_CYCLE[0]);
+const double BBR_CWND_GAIN = 2;     // In PROBE_BW, leaves room for delayed and stretched ACKs.
+const uint32_t BBR_MIN_WINDOW = 4;  // Packets.
+const int BBR_FULL_BW_ROUNDS = 3;   // Rounds without 25% growth before STARTUP ends.
+const int64_t BBR_MIN_RTT_EXPIRY = 10000000; // µs before min_rtt is measured again.
+const int64_t BBR_PROBE_RTT_TIME = 200000;   // µs spent at BBR_MIN_WINDOW to measure it.
+const uint64_t BBR_MAX_QUANTUM = 16384;      // Bytes: the most sent back to back, well inside socket buffers.
+
+Bbr::Bbr(uint32_t mss, uint32_t initial_window) {
+    this->mss = mss;
+    this->startup_window = initial_window * mss;
+    this->setMode(STARTUP, 0);
+}
+
+uint64_t Bbr::bandwidth() const {
+    return *max_element(this->round_bw, this->round_bw + BW_ROUNDS);
+}
+
+// Bandwidth-delay product in bytes, or the window to start with until both are measured.
+uint32_t Bbr::bdp() const {
+    uint64_t bw = this->bandwidth();
+    if (bw == 0 || this->min_rtt == 0) {
+        return this->startup_window;
+    }
+    return (uint32_t) min(bw * this->min_rtt / 1000000, (uint64_t) UINT32_MAX);
+}
+
+uint32_t Bbr::cwnd() const {
+    uint32_t floor = BBR_MIN_WINDOW * this->mss;
+    if (this->mode == PROBE_RTT) {
+        return floor;
+    }
+    // Packets go out in quanta and come back ACKed in batches, so on top of the
+    // BDP the window needs room for a few quanta, or on a path whose BDP is a
+    // packet or two (loopback) it would hold the sender to a trickle.
+    double window = this->cwnd_gain * this->bdp() + 3.0 * this->sendQuantum();
+    return max((uint32_t) min(window, (double) UINT32_MAX), floor);
+}
+
+uint64_t Bbr::pacingRate() const {
+    return (uint64_t) (this->pacing_gain * this->bandwidth());
+}
+
+// Bytes sent back to back at the pacing rate: 1 ms worth, from two packets up to BBR_MAX_QUANTUM.
+uint32_t Bbr::sendQuantum() const {
+    uint64_t quantum = this->pacingRate() / 1000;
+    return (uint32_t) min(max(quantum, (uint64_t) 2 * this->mss), BBR_MAX_QUANTUM);
+}
+
+void Bbr::setMode(Mode mode, int64_t now) {
+    this->mode = mode;
+    switch (mode) {
+        case STARTUP:
+            this->pacing_gain = BBR_HIGH_GAIN;
+            this->cwnd_gain = BBR_HIGH_GAIN;
+            break;
+        case DRAIN:
+            // Send below the bottleneck rate until the queue STARTUP built is gone.
+            this->pacing_gain = 1 / BBR_HIGH_GAIN;
+            this->cwnd_gain = BBR_HIGH_GAIN;
+            break;
+        case PROBE_BW:
+            this->cycle = 2; // Start cruising, not probing or draining.
+            this->pacing_gain = BBR_CYCLE[this->cycle];
+            this->cwnd_gain = BBR_CWND_GAIN;
+            break;
+        case PROBE_RTT:
+            this->pacing_gain = 1;
+            this->cwnd_gain = 1;
+            this->probe_rtt_done = now + BBR_PROBE_RTT_TIME;
+            this->probe_rtt_sampled = false;
+            break;
+    }
+}
+
+void Bbr::onAck(uint32_t acked, int64_t rtt, uint32_t inflight, int64_t now) {
+    // Propagation delay: the lowest RTT seen. In PROBE_RTT, with next to nothing
+    // queued, whatever is measured replaces it.
+    if (rtt > 0) {
+        if (this->mode == PROBE_RTT) {
+            if (!this->probe_rtt_sampled || rtt < this->min_rtt) {
+                this->min_rtt = rtt;
+            }
+            this->probe_rtt_sampled = true;
+            this->min_rtt_stamp = now;
+        } else if (this->min_rtt == 0 || rtt <= this->min_rtt) {
+            this->min_rtt = rtt;
+            this->min_rtt_stamp = now;
+        }
+    }
+    this->startup_window += acked;
+
+    // Bottleneck bandwidth: the delivery rate of each round trip. Rounds are timed
+    // by what is delivered rather than by the clock, and each sample spans this
+    // round and the one before. The data ACKed in this round was sent during the
+    // last one, so the sample covers its whole round trip: ACKs that arrive in a
+    // batch can't make the rate look higher than the path gives.
+    this->delivered += acked;
+    if (this->round_start == 0) {
+        this->round_start = now;
+        this->round_delivered = this->delivered;
+        this->round_end = this->delivered + inflight;
+    }
+    if (this->delivered >= this->round_end && now > this->round_start) {
+        // (The first round has no round before it to span: it gives no sample.)
+        if (this->prev_round_start > 0) {
+            this->round = (this->round + 1) % BW_ROUNDS;
+            uint64_t sample = (this->delivered - this->prev_round_delivered) * 1000000 / (now - this->prev_round_start);
+            // Nor may a sample pass the pacing rate: the estimate grows by at most the
+            // pacing gain a round, and a jump beyond that is ACKs bunched up on the
+            // way back, not bandwidth.
+            if (this->bandwidth() > 0) {
+                sample = min(sample, this->pacingRate());
+            }
+            this->round_bw[this->round] = sample;
+        }
+        this->prev_round_start = this->round_start;
+        this->prev_round_delivered = this->round_delivered;
+        this->round_start = now;
+        this->round_delivered = this->delivered;
+        this->round_end = this->delivered + inflight;
+
+        if (this->mode == STARTUP) {
+            // The pipe is full once three rounds in a row grow the bandwidth by less than 25%.
+            if (this->bandwidth() >= this->full_bw * 5 / 4) {
+                this->full_bw = this->bandwidth();
+                this->full_bw_rounds = 0;
+            } else if (++this->full_bw_rounds >= BBR_FULL_BW_ROUNDS) {
+                this->setMode(DRAIN, now);
+            }
+        } else if (this->mode == PROBE_BW) {
+            this->cycle = (this->cycle + 1) % BBR_CYCLE_LENGTH;
+            this->pacing_gain = BBR_CYCLE[this->cycle];
+        }
+    }
+
+    if (this->mode == DRAIN && inflight <= this->bdp()) {
+        this->setMode(PROBE_BW, now);
+    }
+    if (this->mode == PROBE_RTT && now >= this->probe_rtt_done) {
+        this->setMode(PROBE_BW, now);
+    } else if (this->mode != PROBE_RTT && this->min_rtt > 0 && now - this->min_rtt_stamp > BBR_MIN_RTT_EXPIRY) {
+        // min_rtt may be stale: shrink to a few packets for a moment to measure it again.
+        this->setMode(PROBE_RTT, now);
+    }
+}
+
+void Bbr::onTimeout(int64_t now) {
+    // Keep the model: one lost packet says nothing about the path's bandwidth or
+    // delay, so there is no reason to drop to one packet. The timer's own backoff
+    // covers a path that really went away.
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <stdint.h>
+
+// How much the sender may have in flight, and how fast to send it. The server
+// reports what happens to its packets; the controller keeps the window (bytes)
+// and, for model-based controllers, a pacing rate. Windows are counted in bytes
+// of payload, in units of mss, the payload of one full packet. Times are
+// monotonicMicros().
+class CongestionControl {
+public:
+    virtual ~CongestionControl() {}
+
+    // Make the controller called name ("reno", "cubic" or "bbr"), or NULL if there
+    // is none. Loss-based ones start with the given window and slow start threshold
+    // (packets).
+    static CongestionControl* create(const char* name, uint32_t mss, uint32_t initial_window, uint32_t initial_ssthresh);
+
+    virtual const char* name() const = 0;
+
+    // The cumulative ACK moved on by acked bytes. rtt is the round trip measured
+    // with this ACK (0 if it gave none), inflight the bytes still unACKed.
+    virtual void onAck(uint32_t acked, int64_t rtt, uint32_t inflight, int64_t now) = 0;
+
+    // A duplicate ACK beyond the one that signalled loss.
+    virtual void onDupAck() {}
+
+    // Loss, detected by duplicate ACKs. The holes are being resent.
+    virtual void onLoss(int64_t now) = 0;
+
+    // A retransmission timer expired.
+    virtual void onTimeout(int64_t now) = 0;
+
+    // Bytes allowed in flight.
+    virtual uint32_t cwnd() const = 0;
+
+    // Slow start threshold (bytes), for the status line.
+    virtual uint32_t ssthresh() const = 0;
+
+    // Bytes per second to pace packets out at, or 0 to send as fast as cwnd allows.
+    virtual uint64_t pacingRate() const { return 0; }
+};
+
+// TCP Reno (RFC 5681): slow start, then one packet per window of ACKed bytes;
+// halve on loss with fast recovery, back to one packet on timeout.
+class Reno : public CongestionControl {
+public:
+    Reno(uint32_t mss, uint32_t initial_window, uint32_t initial_ssthresh);
+
+    const char* name() const { return "reno"; }
+    void onAck(uint32_t acked, int64_t rtt, uint32_t inflight, int64_t now);
+    void onDupAck();
+    void onLoss(int64_t now);
+    void onTimeout(int64_t now);
+    uint32_t cwnd() const { return this->window; }
+    uint32_t ssthresh() const { return this->threshold; }
+
+private:
+    uint32_t mss;
+    uint32_t window;
+    uint32_t threshold;
+    uint32_t ca_acked = 0; // Bytes ACKed towards the next increase in congestion avoidance.
+    bool recovery = false; // In fast recovery: the window is inflated by duplicate ACKs.
+};
+
+// CUBIC (RFC 9438): after a loss the window follows a cubic function of the time
+// since, flat around the window where the loss happened and steep away from it,
+// so it gets back to a high-BDP path's capacity in seconds, not thousands of RTTs.
+class Cubic : public CongestionControl {
+public:
+    Cubic(uint32_t mss, uint32_t initial_window, uint32_t initial_ssthresh);
+
+    const char* name() const { return "cubic"; }
+    void onAck(uint32_t acked, int64_t rtt, uint32_t inflight, int64_t now);
+    void onLoss(int64_t now);
+    void onTimeout(int64_t now);
+    uint32_t cwnd() const { return (uint32_t) (this->window * this->mss); }
+    uint32_t ssthresh() const { return (uint32_t) (this->threshold * this->mss); }
+
+private:
+    uint32_t mss;
+    // Windows in packets, as fractions so growth by less than a packet per ACK adds up.
+    double window;
+    double threshold;
+    double w_max = 0;     // Window at the last loss.
+    double w_est = 0;     // What Reno would have by now, so CUBIC is never slower than it.
+    double k = 0;         // Seconds from the start of the epoch until the window is back at w_max.
+    int64_t epoch_start = 0; // When growth after the last loss began, 0 if it hasn't yet.
+    int64_t min_rtt = 0;
+
+    void reduce(); // Multiplicative decrease, shared by loss and timeout.
+};
+
+// BBR-style model-based control: rather than reacting to loss, estimate the
+// bottleneck bandwidth (the best delivery rate over recent rounds) and the
+// propagation delay (the lowest RTT in a while), and keep about one
+// bandwidth-delay product in flight, paced at the bottleneck rate. Starts by
+// doubling its rate every round until the bandwidth stops growing, drains the
+// queue that built, then cycles its pacing gain to probe for more bandwidth.
+class Bbr : public CongestionControl {
+public:
+    Bbr(uint32_t mss, uint32_t initial_window);
+
+    const char* name() const { return "bbr"; }
+    void onAck(uint32_t acked, int64_t rtt, uint32_t inflight, int64_t now);
+    void onLoss(int64_t now) {} // Loss isn't a signal to the model.
+    void onTimeout(int64_t now);
+    uint32_t cwnd() const;
+    uint32_t ssthresh() const { return this->bdp(); }
+    uint64_t pacingRate() const;
+
+private:
+    enum Mode { STARTUP, DRAIN, PROBE_BW, PROBE_RTT };
+    static const int BW_ROUNDS = 10; // Rounds the bandwidth estimate is the maximum over.
+
+    uint32_t mss;
+    Mode mode = STARTUP;
+    double pacing_gain;
+    double cwnd_gain;
+    int cycle = 0; // Position in the PROBE_BW gain cycle.
+
+    // Delivery rate (bytes/s) sampled at the end of each of the last BW_ROUNDS
+    // rounds. A round lasts until everything in flight when it started has been
+    // ACKed: one round trip.
+    uint64_t round_bw[BW_ROUNDS] = {0};
+    int round = 0;
+    uint64_t delivered = 0; // Bytes ACKed since the start.
+    uint64_t round_end = 0; // The current round ends once delivered reaches this.
+    int64_t round_start = 0, prev_round_start = 0;          // When this round and the last began,
+    uint64_t round_delivered = 0, prev_round_delivered = 0; // and delivered then.
+
+    uint64_t full_bw = 0; // STARTUP: bandwidth at the last round it grew by 25%,
+    int full_bw_rounds = 0; // and rounds since.
+
+    int64_t min_rtt = 0;
+    int64_t min_rtt_stamp = 0; // When min_rtt was measured.
+    int64_t probe_rtt_done = 0; // When PROBE_RTT ends.
+    bool probe_rtt_sampled = false; // Has PROBE_RTT measured a round trip yet?
+    uint32_t startup_window; // cwnd until there is a model: grows like slow start.
+
+    uint64_t bandwidth() const;
+    uint32_t bdp() const;
+    uint32_t sendQuantum() const;
+    void setMode(Mode mode, int64_t now);
+};
@@ -0,0 +1,146 @@
+#include "file_writer.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+
+const size_t DIRECT_ALIGN = 4096;              // Covers the logical block size of any disk we'll meet.
+const size_t DIRECT_BUFFER_SIZE = 4 << 20;     // Multiple of DIRECT_ALIGN.
+const off_t PREALLOCATE_STEP = (off_t) 64 << 20;
+
+FileWriter::FileWriter(const char* path, bool direct) {
+    if (direct) {
+        this->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (this->fd >= 0) {
+            this->direct = true;
+            if (posix_memalign((void**) &this->buffer, DIRECT_ALIGN, DIRECT_BUFFER_SIZE) != 0) {
+                fprintf(stderr, "Unable to allocate write buffer. Exiting.\n");
+                exit(1);
+            }
+        } else {
+            fprintf(stderr, "O_DIRECT not supported for %s (%s). Using buffered writes.\n", path, strerror(errno));
+        }
+    }
+    if (this->fd < 0) {
+        this->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (this->fd < 0) {
+        fprintf(stderr, "Error opening %s: %s. Exiting.\n", path, strerror(errno));
+        exit(1);
+    }
+}
+
+FileWriter::~FileWriter() {
+    this->close();
+}
+
+void FileWriter::write(const struct iovec* iov, int iovcnt) {
+    if (!this->direct) {
+        this->writeAll(iov, iovcnt);
+        return;
+    }
+    for (int i = 0; i < iovcnt; i++) {
+        const uint8_t* data = (const uint8_t*) iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (len > 0) {
+            size_t n = DIRECT_BUFFER_SIZE - this->buffered;
+            if (n > len) {
+                n = len;
+            }
+            memcpy(this->buffer + this->buffered, data, n);
+            this->buffered += n;
+            this->file_size += n;
+            data += n;
+            len -= n;
+            if (this->buffered == DIRECT_BUFFER_SIZE) {
+                this->flush();
+            }
+        }
+    }
+}
+
+// writev() the lot, picking up after short writes.
+void FileWriter::writeAll(const struct iovec* iov, int iovcnt) {
+    struct iovec rest[IOV_MAX];
+    if (iovcnt > IOV_MAX) {
+        this->writeAll(iov, IOV_MAX);
+        this->writeAll(iov + IOV_MAX, iovcnt - IOV_MAX);
+        return;
+    }
+    memcpy(rest, iov, iovcnt * sizeof(struct iovec));
+    struct iovec* next = rest;
+    while (iovcnt > 0) {
+        ssize_t written = writev(this->fd, next, iovcnt);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Error writing file: %s. Exiting.\n", strerror(errno));
+            exit(1);
+        }
+        this->file_size += written;
+        while (iovcnt > 0 && (size_t) written >= next->iov_len) {
+            written -= next->iov_len;
+            next++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            next->iov_base = (uint8_t*) next->iov_base + written;
+            next->iov_len -= written;
+        }
+    }
+}
+
+// Write out the direct-mode buffer. Only the last flush, from close(), may be
+// partial: it is padded to DIRECT_ALIGN, and close() cuts the padding off again.
+void FileWriter::flush() {
+    if (this->buffered == 0) {
+        return;
+    }
+    size_t len = (this->buffered + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+    if (this->flushed + (off_t) len > this->allocated) {
+        // Best effort: not every filesystem can preallocate.
+        if (fallocate(this->fd, FALLOC_FL_KEEP_SIZE, this->allocated, PREALLOCATE_STEP) == 0) {
+            this->allocated += PREALLOCATE_STEP;
+        }
+    }
+    memset(this->buffer + this->buffered, 0, len - this->buffered);
+
+    size_t done = 0;
+    while (done < len) {
+        ssize_t written = pwrite(this->fd, this->buffer + done, len - done, this->flushed + done);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            fprintf(stderr, "Error writing file: %s. Exiting.\n", strerror(errno));
+            exit(1);
+        }
+        done += written;
+    }
+    this->flushed += this->buffered;
+    this->buffered = 0;
+}
+
+void FileWriter::close() {
+    if (this->fd < 0) {
+        return;
+    }
+    if (this->direct) {
+        this->flush();
+        if (ftruncate(this->fd, this->file_size) < 0) {
+            fprintf(stderr, "Error truncating file: %s.\n", strerror(errno));
+        }
+        // Give back what was preallocated past the end.
+        if (this->allocated > this->file_size) {
+            fallocate(this->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, this->file_size, this->allocated - this->file_size);
+        }
+        free(this->buffer);
+        this->buffer = NULL;
+    }
+    ::close(this->fd);
+    this->fd = -1;
+}
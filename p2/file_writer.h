@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// Appends to a file in large writes. By default each write() call hands its
+// pieces straight to writev(). In direct mode the data is gathered into an
+// aligned write-behind buffer and written with O_DIRECT, bypassing the page
+// cache, while the file is preallocated ahead of the writes with fallocate(), so
+// multi-GB files don't flood the cache or end up fragmented.
+class FileWriter {
+public:
+    // Creates (or truncates) path. Exits if it can't be opened. Direct mode
+    // falls back to ordinary writes where the filesystem doesn't support O_DIRECT.
+    FileWriter(const char* path, bool direct = false);
+    ~FileWriter();
+
+    // Append the iovcnt pieces described by iov. Exits on error.
+    void write(const struct iovec* iov, int iovcnt);
+
+    // Flush anything buffered and close the file.
+    void close();
+
+    off_t size() const { return this->file_size; }
+
+private:
+    int fd = -1;
+    bool direct = false;
+    off_t file_size = 0;   // Bytes appended so far.
+    off_t allocated = 0;   // Bytes preallocated (direct mode).
+    uint8_t* buffer = NULL; // Write-behind buffer (direct mode).
+    size_t buffered = 0;
+    off_t flushed = 0;     // File offset the buffer starts at.
+
+    FileWriter(const FileWriter&) = delete;
+    FileWriter& operator=(const FileWriter&) = delete;
+
+    void writeAll(const struct iovec* iov, int iovcnt);
+    void flush();
+};
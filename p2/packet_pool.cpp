@@ -0,0 +1,77 @@
+#include "packet_pool.h"
+
+const int CACHE_LINE = 64;
+
+PacketPool::PacketPool(int buffer_size, int buffers_per_slab) {
+    this->buffer_size = buffer_size;
+    this->stride = (buffer_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    this->buffers_per_slab = buffers_per_slab;
+}
+
+PacketPool::~PacketPool() {
+    this->freeSlabs();
+}
+
+void PacketPool::freeSlabs() {
+    for (uint8_t* slab : this->slabs) {
+        delete[] slab;
+    }
+    this->slabs.clear();
+    this->free_list = NULL;
+}
+
+bool PacketPool::resize(int buffer_size) {
+    if (this->stats.in_use != 0) {
+        return false;
+    }
+    if (buffer_size != this->buffer_size) {
+        this->freeSlabs();
+        this->buffer_size = buffer_size;
+        this->stride = (buffer_size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    }
+    return true;
+}
+
+// Allocate one more slab and put all of its buffers on the free list.
+void PacketPool::grow() {
+    size_t slab_size = (size_t) this->stride * this->buffers_per_slab;
+    uint8_t* slab = new uint8_t[slab_size];
+    this->slabs.push_back(slab);
+    this->stats.heap_allocations++;
+    this->stats.heap_bytes += slab_size;
+
+    for (int i = this->buffers_per_slab - 1; i >= 0; i--) {
+        FreeBuffer* buffer = (FreeBuffer*) (slab + (size_t) i * this->stride);
+        buffer->next = this->free_list;
+        this->free_list = buffer;
+    }
+}
+
+uint8_t* PacketPool::get() {
+    if (this->free_list == NULL) {
+        this->grow();
+    }
+    FreeBuffer* buffer = this->free_list;
+    this->free_list = buffer->next;
+
+    this->stats.gets++;
+    if (++this->stats.in_use > this->stats.high_water) {
+        this->stats.high_water = this->stats.in_use;
+    }
+    return (uint8_t*) buffer;
+}
+
+void PacketPool::put(uint8_t* buffer) {
+    FreeBuffer* free_buffer = (FreeBuffer*) buffer;
+    free_buffer->next = this->free_list;
+    this->free_list = free_buffer;
+
+    this->stats.puts++;
+    this->stats.in_use--;
+}
+
+void PacketPool::printStats(FILE* out, const char* name) const {
+    fprintf(out, "%s: %lu buffers handed out, %lu returned, %d in use (peak %d), %lu heap allocations (%zu bytes)\n",
+            name, this->stats.gets, this->stats.puts, this->stats.in_use, this->stats.high_water,
+            this->stats.heap_allocations, this->stats.heap_bytes);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// Fixed-size packet buffers carved out of large slabs. Returned buffers go on a
+// free list and are handed out again, so once the pool has grown to cover the
+// window, sending and receiving packets does no heap allocation at all.
+class PacketPool {
+public:
+    struct Stats {
+        unsigned long gets = 0;             // Buffers handed out.
+        unsigned long puts = 0;             // Buffers returned.
+        unsigned long heap_allocations = 0; // Slabs allocated from the heap.
+        size_t heap_bytes = 0;
+        int in_use = 0;
+        int high_water = 0;                 // Most buffers ever in use at once.
+    };
+    Stats stats;
+
+    // Buffers hold buffer_size bytes each and are allocated buffers_per_slab at a time.
+    PacketPool(int buffer_size, int buffers_per_slab = 256);
+    ~PacketPool();
+
+    // Take a buffer from the pool, growing it by a slab if none are free.
+    uint8_t* get();
+
+    // Give back a buffer returned by get().
+    void put(uint8_t* buffer);
+
+    int bufferSize() const { return this->buffer_size; }
+
+    // Switch to buffers of a different size, e.g. once the packet size has been
+    // negotiated. Only possible while no buffers are handed out; returns false
+    // (and changes nothing) otherwise.
+    bool resize(int buffer_size);
+
+    void printStats(FILE* out, const char* name = "Packet pool") const;
+
+private:
+    struct FreeBuffer {
+        FreeBuffer* next;
+    };
+
+    int buffer_size;
+    int stride; // buffer_size rounded up to a cache line, so buffers don't share lines.
+    int buffers_per_slab;
+    std::vector<uint8_t*> slabs;
+    FreeBuffer* free_list = NULL;
+
+    PacketPool(const PacketPool&) = delete;
+    PacketPool& operator=(const PacketPool&) = delete;
+
+    void grow();
+    void freeSlabs();
+};
@@ -4,7 +4,12 @@
 #include <sys/time.h>
 #include <sys/types.h>   // definitions of a number of data types used in socket.h and netinet/in.h
 #include <sys/socket.h>  // definitions of structures needed for sockets, e.g. sockaddr
+#include <sys/uio.h>     // struct iovec
+#include <sys/mman.h>    // mmap(), madvise()
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <netinet/in.h>  // constants and structures needed for internet domain addresses, e.g. sockaddr_in
+#include <netinet/udp.h> // UDP_SEGMENT
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -12,23 +17,48 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <queue>
+#include <functional>
 #include <fstream>
 #include <ctime>
 #include <signal.h>
+#include <poll.h>
+#include <new>
+#include <algorithm>
+#include <utility>
+
+#include "packet_pool.h"
+#include "send_window.h"
+#include "reorder_buffer.h"
+#include "file_writer.h"
 
 using namespace std;
 
 // Define constants (bytes).
-const int MAX_PKT_SIZE = 1024; // Including headers.
-const int MAX_SEQNO = 30720;
-const int INITIAL_WINDOW = 5120; // Just the default.
+// Packet sizes include headers. The size a connection uses is agreed on in the
+// SYN/SYNACK handshake: the smaller of what each end offers, limited by the path MTU.
+const int DEFAULT_PKT_SIZE = 1024; // Used when the peer doesn't offer a size.
+const int MIN_PKT_SIZE = 548;      // 576-byte minimum IPv4 datagram, less IP and UDP headers.
+const int MAX_PKT_SIZE = 65507;    // Largest UDP payload over IPv4, e.g. on loopback.
+const int IP_UDP_HEADER_SIZE = 28;
+const int INITIAL_WINDOW = 5; // Packets. Just the default.
 
 const int FAST_RETRANSMIT_THRESH = 3;
-const struct timeval TIMEOUT = {
-    0,     /* tv_sec  */
-    500000 /* tv_usec */
-};
-const struct timeval NOTIMEOUT = {0,0};
+
+// Batched socket I/O: datagrams per sendmmsg()/recvmmsg() call, and how many
+// equal-sized packets one UDP GSO send may carry.
+const int BATCH_SIZE = 64;
+const int GSO_MAX_SEGMENTS = 64;
+const int GSO_MAX_BYTES = 65000;
+const int SOCKET_BUFFER_PACKETS = 256;
+const int WRITE_BATCH = 256; // In-order packets the client writes to file per writev().
+const off_t RELEASE_STEP = 1 << 20; // Sent file data the server lets go of at a time (bytes).
+const int TIMEOUT = 500;  // Retransmission timeout (ms) until the round-trip time has been measured.
+const int ACK_EVERY = 2; // The client ACKs every this many in-order packets...
+const int ACK_DELAY = 5; // ...or this many ms after the first one it holds back.
+const int MIN_RTO = 20;     // Bounds on the measured retransmission timeout (ms).
+const int MAX_RTO = 60000;
+const int NOTIMEOUT = -1; // Wait for ever.
 
 // TODO: Do we include header size when incrementing sequence number? Switch this to true if so.
 const bool INCHEADER = false;
@@ -36,6 +66,7 @@ const bool INCHEADER = false;
 // TCP Header Flags
 const int FIN = 1;   // 0b00000001;
 const int SYN = 2;   // 0b00000010;
+const int SACK = 4;  // 0b00000100; ACK carries a SackInfo payload.
 const int ACK = 16;  // 0b00010000;
 const int CWR = 128; // 0b10000000;
 const int SYNACK = ACK | SYN;
@@ -59,68 +90,210 @@ struct PacketHeader {
 };
 
 const int HEADER_SIZE = sizeof(PacketHeader);
-const int MAX_PKT_SIZE_SANS_HEADER = MAX_PKT_SIZE - HEADER_SIZE;
 
-// TCP Packet. Created with an optional payload (shallow copy!).
+// Payload of an ACK with the SACK flag: the receiver's view of the whole stream,
+// not just the packet in ackno. Everything before cumackno has arrived, and so
+// have the ranges [start, end) of sequence space in blocks, nearest first.
+// Only as many blocks as there are are sent.
+const int MAX_SACK_BLOCKS = 8;
+
+struct SackBlock {
+    uint32_t start;
+    uint32_t end;
+};
+
+struct SackInfo {
+    uint32_t cumackno = 0;
+    SackBlock blocks[MAX_SACK_BLOCKS];
+};
+
+inline int sackInfoSize(int nblocks) {
+    return sizeof(uint32_t) + nblocks * sizeof(SackBlock);
+}
+
+// Wire buffers for every packet, header first. They start out DEFAULT_PKT_SIZE
+// bytes long and are resized to the largest packet this end will send or accept
+// before the handshake gets that far.
+inline PacketPool& packet_pool() {
+    static PacketPool pool(DEFAULT_PKT_SIZE);
+    return pool;
+}
+
+// Header-only wire buffers, for packets whose payload lives elsewhere (see Packet::referencing()).
+inline PacketPool& header_pool() {
+    static PacketPool pool(HEADER_SIZE);
+    return pool;
+}
+
+// Sequence numbers count bytes modulo 2^32 and wrap around, so they are compared
+// as serial numbers (RFC 1982): a comes before b if b is less than 2^31 ahead.
+inline bool seqBefore(uint32_t a, uint32_t b) {
+    return (int32_t) (a - b) < 0;
+}
+
+// A random initial sequence number anywhere in the 32-bit space.
+inline uint32_t initialSeqno() {
+    return ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+}
+
+// Microseconds on the monotonic clock, which (unlike the time of day) never jumps.
+// Served from the vDSO, so it costs no syscall.
+inline int64_t monotonicMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+// Wait up to timeout ms (NOTIMEOUT: for ever) for data on sockfd. Returns false on timeout.
+inline bool waitReadable(int sockfd, int timeout) {
+    struct pollfd pfd;
+    pfd.fd = sockfd;
+    pfd.events = POLLIN;
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout);
+    } while (ready < 0 && errno == EINTR);
+    return ready > 0;
+}
+
+// Largest packet that reaches addr without IP fragmentation, going by the route
+// MTU the kernel knows (65535 on loopback, 1500 or 9000 on Ethernet).
+inline int pathPacketSize(const struct sockaddr_in &addr) {
+    int size = DEFAULT_PKT_SIZE;
+    int probe = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (probe >= 0) {
+        int mtu;
+        socklen_t mtulen = sizeof(mtu);
+        if (connect(probe, (const struct sockaddr*) &addr, sizeof(addr)) == 0
+            && getsockopt(probe, IPPROTO_IP, IP_MTU, &mtu, &mtulen) == 0) {
+            size = mtu - IP_UDP_HEADER_SIZE;
+        }
+        close(probe);
+    }
+    return min(max(size, MIN_PKT_SIZE), MAX_PKT_SIZE);
+}
+
+// Make the socket buffers big enough for a window of pkt_size packets. The
+// kernel quietly caps this at net.core.[rw]mem_max.
+inline void sizeSocketBuffers(int sockfd, int pkt_size) {
+    int bytes = SOCKET_BUFFER_PACKETS * pkt_size;
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+}
+
+// TCP Packet. Header and payload sit together in one pooled wire buffer, which
+// the packet owns: it goes out with a single send and back to the pool when the
+// packet is destroyed. Packets can be moved (into the send window or the
+// receive buffer) but never copied.
+//
+// A referencing packet owns only its header; the payload is borrowed from memory
+// that outlives the packet (the server's mapping of the file), and is gathered
+// from there each time the packet is sent.
 class Packet {
 public:
-    uint8_t* payload = NULL;
-    PacketHeader header;
-    int packet_size; // header + payload, in bytes
+    uint8_t* buffer = NULL; // Wire buffer from packet_pool() (header_pool() if referencing), NULL once moved from.
+    const uint8_t* payload_ref = NULL; // Borrowed payload, or NULL if it follows the header in buffer.
+    int packet_size = 0; // header + payload, in bytes
     bool acked = false;
-    struct timeval timeout_time; // Timestamp of when a packet will timeout. Updated whenever a packet is sent/resent.
+    int64_t timeout_time = 0; // When the packet will timeout (monotonicMicros()). Updated whenever a packet is sent/resent.
+    int64_t sent_time = 0; // When the packet last went out (monotonicMicros()).
+    bool retransmitted = false; // Sent more than once, so its ACK can't be timed (Karn's rule).
 
-    // For reading.
-    Packet(PacketHeader header, uint8_t* payload = NULL, int payload_size = 0) {
-        if (payload) {        
-            this->payload = new uint8_t[payload_size]; 
-            memcpy(this->payload, payload, payload_size);
+    Packet() {}
+
+    // For sending. The payload, if given, is copied in; with a NULL payload,
+    // payload_size bytes are left for the caller to fill in through payload().
+    Packet(int flag, uint32_t seqno = 0, uint32_t ackno = 0, const uint8_t* payload = NULL, int payload_size = 0) {
+        this->buffer = packet_pool().get();
+        new (this->buffer) PacketHeader(seqno, ackno, flag);
+        if (payload) {
+            memcpy(this->payload(), payload, payload_size);
         }
-        this->header = header;
         this->packet_size = HEADER_SIZE + payload_size;
-        // gettimeofday(&(this->timeout), NULL);
-        // timeradd(&TIMEOUT, &(this->timeout), &(this->timeout));
     }
-    // For sending.
-    Packet(int flag, int seqno = 0, int ackno = 0, uint8_t* payload = NULL, int payload_size = 0) {
-        this->header.ackno = ackno;
-        this->header.seqno = seqno;
-        this->header.flags |= flag;
-
-        this->payload = new uint8_t[payload_size]; 
-        memcpy(this->payload, payload, payload_size);
-        
-        this->packet_size = payload_size + HEADER_SIZE;
-        // gettimeofday(&(this->timeout), NULL);
-        // timeradd(&TIMEOUT, &(this->timeout), &(this->timeout));
+
+    // For reading. Takes over a pooled buffer holding packet_size bytes off the wire.
+    Packet(uint8_t* buffer, int packet_size) {
+        this->buffer = buffer;
+        this->packet_size = packet_size;
     }
-    // Deep copy.
-    Packet(Packet* &packet) {
-        this->packet_size = packet->packet_size;
-        if (packet->payload != NULL) {
-            this->payload = new uint8_t[packet->packet_size - HEADER_SIZE];
-            memcpy(this->payload, packet->payload, this->packet_size - HEADER_SIZE);
-            // for (int i = 0; i < packet->packet_size - HEADER_SIZE; i++) {
-            //     this->payload[i] = packet->payload[i];
-            // }
-        }
-        this->header = packet->header;
-        this->acked = packet->acked;
-        this->timeout_time = packet->timeout_time;
 
-        // gettimeofday(&(this->timeout), NULL);
-        // timeradd(&TIMEOUT, &(this->timeout), &(this->timeout));
+    // For sending payload_size bytes at payload without copying them. They must
+    // stay put, unchanged, for as long as the packet may be (re)sent.
+    static Packet referencing(int flag, uint32_t seqno, uint32_t ackno, const uint8_t* payload, int payload_size) {
+        Packet packet;
+        packet.buffer = header_pool().get();
+        new (packet.buffer) PacketHeader(seqno, ackno, flag);
+        packet.payload_ref = payload;
+        packet.packet_size = HEADER_SIZE + payload_size;
+        return packet;
     }
 
-    Packet() {}
+    Packet(Packet&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    Packet& operator=(Packet&& other) noexcept {
+        if (this != &other) {
+            this->release();
+            this->buffer = other.buffer;
+            this->payload_ref = other.payload_ref;
+            this->packet_size = other.packet_size;
+            this->acked = other.acked;
+            this->timeout_time = other.timeout_time;
+            this->sent_time = other.sent_time;
+            this->retransmitted = other.retransmitted;
+            other.buffer = NULL;
+            other.payload_ref = NULL;
+            other.packet_size = 0;
+        }
+        return *this;
+    }
+
+    Packet(const Packet&) = delete;
+    Packet& operator=(const Packet&) = delete;
+
+    ~Packet() { this->release(); }
+
+    PacketHeader& header() { return *(PacketHeader*) this->buffer; }
+    const PacketHeader& header() const { return *(const PacketHeader*) this->buffer; }
+    uint8_t* payload() { return this->payload_ref? (uint8_t*) this->payload_ref : this->buffer + HEADER_SIZE; }
+    int payloadSize() const { return this->packet_size - HEADER_SIZE; }
+
+    // Point iov at the packet's bytes as they go on the wire. Returns the number
+    // of entries used: 1, or 2 for a referencing packet with a payload.
+    int wireIovec(struct iovec* iov) {
+        if (this->payload_ref == NULL) {
+            iov[0].iov_base = this->buffer;
+            iov[0].iov_len = this->packet_size;
+            return 1;
+        }
+        iov[0].iov_base = this->buffer;
+        iov[0].iov_len = HEADER_SIZE;
+        if (this->payloadSize() == 0) {
+            return 1;
+        }
+        iov[1].iov_base = (void*) this->payload_ref;
+        iov[1].iov_len = this->payloadSize();
+        return 2;
+    }
 
-    // Packet() {
-    //     if (this->payload != NULL) {
-    //         delete this->payload;
-    //     }
-    // }
+private:
+    void release() {
+        if (this->buffer != NULL) {
+            (this->payload_ref? header_pool() : packet_pool()).put(this->buffer);
+            this->buffer = NULL;
+        }
+    }
+};
 
-//    ~Packet() { if (payload != NULL) delete this->payload; }
+// Run-time switches, set from the command line.
+struct RdtOptions {
+    bool batch_io = true; // Use sendmmsg()/recvmmsg() rather than a syscall per datagram.
+    bool gso = true;      // Let the kernel split runs of equal-sized packets (UDP_SEGMENT). Needs batch_io.
+    int max_pkt_size = MAX_PKT_SIZE; // Largest packet this end offers in the handshake.
+    bool direct_io = false; // Client: write the file with O_DIRECT, preallocating it as it grows.
+    int ack_every = ACK_EVERY; // Client: in-order packets per ACK; 1 ACKs every packet.
 };
 
 class Client {
@@ -128,25 +301,62 @@ public:
     int sockfd;
     struct sockaddr_in serverinfo;
 
-    vector<uint16_t> last_seqnos; // Stores the sequence numbers of the last MAX_SEQNO/MAX_PKT_SIZE_SANS_HEADER packets we have seen. Used to check for duplicate packets.
-    vector<Packet*> rcv_window; // Store received packets in a buffer.
-    uint16_t rcv_base; // Base seqno in packet_buffer.
+    int pkt_size = DEFAULT_PKT_SIZE; // Largest packet the server may send us, as agreed in the handshake.
+
+    ReorderBuffer<Packet> rcv_window; // Packets received ahead of a gap. Its nextSeqno() is the next seqno to write to file.
     
-    uint16_t nextackno; // The next expected seqno. Used to determine whether received a packet is missing or out of order.
+    uint32_t nextackno; // The next expected seqno. Used to determine whether received a packet is missing or out of order.
+
+    // Delayed ACKs: in-order packets received but not ACKed yet, the seqno of the
+    // latest of them, and when they must be ACKed by (monotonicMicros()).
+    int delayed_acks = 0;
+    uint32_t delayed_ackno;
+    int64_t ack_deadline;
+
+    unsigned long acks_sent = 0;  // ACKs sent for data packets...
+    unsigned long acks_saved = 0; // ...and data packets that got none of their own.
+
+    RdtOptions options;
 
     // Creates and binds a socket to the server at port port.
-    Client(char* serverhostname, char* port, char* filename);
+    Client(char* serverhostname, char* port, char* filename, RdtOptions options = RdtOptions());
 
     // Send a packet to the server. Returns bytes sent on success, 0 otherwise.
     int sendPacket(Packet &packet, bool retransmission = false);
 
-    // Wait for a packet from the server and store in buffer. Returns number of bytes read on success, 0 otherwise.
-    int receivePacket(Packet* &packet, bool blocking = true, struct timeval timeout = NOTIMEOUT);
+    // Send count packets to the server, batched into as few syscalls as possible. Exits on error.
+    void sendPackets(Packet* packets, int count);
+
+    // Wait up to timeout ms for a packet from the server and store in buffer. Returns number of bytes read on success, 0 otherwise.
+    int receivePacket(Packet &packet, bool blocking = true, int timeout = NOTIMEOUT);
 
-    void writePacketToFile(ofstream &file, Packet* &packet);
+    // Wait up to timeout ms for packets from the server, then take whatever else has arrived,
+    // up to max. Returns the number of packets stored, or -1 on timeout.
+    int receivePackets(Packet* packets, int max, int timeout = NOTIMEOUT);
 
-    // Returns true if the packet's sequence number has been seen in the last MAX_SEQNO/MAX_PKT_SIZE_SANS_HEADER packets.
-    bool isDuplicatePacket(Packet* &packet);
+    // Print the status line for a packet that just went out.
+    void packetSent(Packet &packet, bool retransmission);
+
+    // ACK the packets with these seqnos, each ACK carrying the SACK state of
+    // rcv_window, in as few syscalls as possible.
+    void sendAcks(uint32_t* seqnos, int count);
+
+    // Decide how to ACK a data packet that just arrived: hold it back if it came
+    // in sequence, otherwise ACK it at once. Appends to acks any seqno to ACK now.
+    void ackPacket(uint32_t seqno, bool in_sequence, uint32_t* acks, int &nacks);
+
+    // Append the held-back ACK, if there is one, to acks.
+    void flushDelayedAck(uint32_t* acks, int &nacks);
+
+    // ms until the held-back ACK is due, or NOTIMEOUT if none is.
+    int delayedAckTimeout();
+
+    // Write every packet that is now in order to file, straight from the packet
+    // buffers with as few writev()s as possible, and drop them from rcv_window.
+    void writeInOrder(FileWriter &file);
+
+    // Returns true if the packet has already been written out or is waiting in rcv_window.
+    bool isDuplicatePacket(Packet &packet);
 };
 
 class Server {
@@ -155,31 +365,98 @@ public:
     uint16_t src_port; // Server port.
     struct sockaddr_in clientinfo, serverinfo; // Client initiates connection, so need to store clientinfo.
 
-    ifstream file; // File we are sending.
+    int filefd = -1; // File we are sending.
     ssize_t filesize;
+    off_t fileoffset = 0; // Where in the file the next chunk starts.
+    const uint8_t* filemap = NULL; // The whole file, mapped read-only; NULL to pread() each chunk into its packet instead.
+    off_t filereleased = 0; // Bytes at the start of filemap already handed back to the kernel.
+
+    SendWindow<Packet> window; // Packets sent but not yet ACKed, oldest first (limited to size of window).
+    int pkt_size = DEFAULT_PKT_SIZE; // Largest packet we send, as agreed in the handshake.
+
+    uint16_t cwnd = INITIAL_WINDOW; // Number of packets allowed in current window.
+    uint32_t baseseqno; // The seqno of the oldest packet which has not been ACKed (bytes).
+    uint32_t nextseqno; // The seqno of the next sendable packet (bytes).
+    uint32_t lastackno; // The client's cumulative ACK, as of its latest SACK: everything before it has arrived.
 
-    vector<Packet*> window; // Packets ready to be sent (limited to size of window).
-    uint16_t cwnd = INITIAL_WINDOW/MAX_PKT_SIZE; // Number of packets allowed in current window.
-    uint16_t baseseqno; // The seqno of the oldest packet which has not been ACKed (bytes).
-    uint16_t nextseqno; // The seqno of the next sendable packet (bytes).
-    uint16_t lastackno; // The last ackno we have received. Remember SR uses cumulative ACKing, so baseseq should be set equal to lastack.
-    int dupacks; // Counter for number of duplicate ACKs we have received (retransmit all unACKed packets on 3).
+    SackBlock sacked[MAX_SACK_BLOCKS]; // Blocks of the client's latest SACK, held beyond lastackno.
+    int nsacked = 0;
 
     bool filename_acked = false; // Has the filename been ACKed yet?
-    int filename_ackno; // ackno of filename ACK.
+    uint32_t filename_ackno; // ackno of filename ACK.
+
+    // Retransmission timeout, estimated from ACK round trips as in RFC 6298 (microseconds).
+    int64_t srtt = 0;   // Smoothed round-trip time, 0 until the first sample.
+    int64_t rttvar = 0; // Round-trip time variation.
+    int64_t rto = TIMEOUT * 1000; // Doubled on every timeout until a fresh sample comes in.
+    int64_t backoff_time = 0; // When rto was last doubled.
+
+    unsigned long packets_sent = 0;    // Including retransmissions...
+    unsigned long retransmissions = 0; // ...of which these many.
+
+    // Retransmission deadlines of sent packets, earliest first, as (timeout_time, seqno).
+    // Entries are never removed early: ones for packets since ACKed or resent
+    // are skipped when they reach the top.
+    typedef pair<int64_t, uint32_t> Deadline;
+    priority_queue<Deadline, vector<Deadline>, greater<Deadline> > timers;
+
+    RdtOptions options;
 
     // Creates and binds a socket at port src_port.
-    Server(char* src_port);
+    Server(char* src_port, RdtOptions options = RdtOptions());
 
     // Send a packet to the connected client. Returns bytes sent on success, 0 otherwise.
     int sendPacket(Packet &packet, bool retransmission = false);
 
-    // Wait for a packet from a client and store in buffer. Returns number of bytes read on success, 0 otherwise.
-    int receivePacket(Packet* &packet, bool blocking = true, struct timeval timeout = NOTIMEOUT);
+    // Send count packets to the client, batched into as few syscalls as possible. Exits on error.
+    void sendPackets(Packet* packets, int count, bool retransmission = false);
+
+    // Send the packets at window[from, to).
+    void sendWindow(size_t from, size_t to, bool retransmission = false);
+
+    // Wait up to timeout ms for a packet from a client and store in buffer. Returns number of bytes read on success, 0 otherwise.
+    int receivePacket(Packet &packet, bool blocking = true, int timeout = NOTIMEOUT);
+
+    // Wait up to timeout ms for packets from the client, then take whatever else has arrived,
+    // up to max. Returns the number of packets stored, or -1 on timeout.
+    int receivePackets(Packet* packets, int max, int timeout = NOTIMEOUT);
+
+    // Restart the packet's timer and print its status line once it has gone out.
+    void packetSent(Packet &packet, bool retransmission);
+
+    // The unACKed packet that times out first, or NULL if none is waiting.
+    Packet* nextTimeout();
+
+    // Mark a packet in the window ACKed, timing its round trip unless it was
+    // retransmitted. Returns the round trip measured (microseconds), or 0.
+    int64_t packetAcked(Packet &packet);
+
+    // Take in the SACK state an ACK carries, if any. Returns true if it moved lastackno on.
+    bool readSack(Packet &ack);
+
+    // Has the client got this packet, going by ACKs and its latest SACK?
+    bool isSacked(Packet &packet);
+
+    // Pop every packet at the front of the window that the client has got, updating baseseqno.
+    void slideWindow();
+
+    // Fold a round-trip time (microseconds) into srtt and rttvar, and recompute rto.
+    void rttSample(int64_t rtt);
+
+    // Back the timeout off after it expired.
+    void backoff();
+
+    // rto in whole ms, for waiting on the socket.
+    int rtoMillis() const { return (int) ((this->rto + 999) / 1000); }
 
     // Send file <filename> to connected client.
     int sendFile(char* filename);
 
-    // Reads the next PACKET_SIZE_SAN_HEADER bytes from the currently open file into buffer. Returns the number of bytes read, or 0 on error.
-    bool sendFileChunk();
+    // Adds a packet for the next packet's worth of the currently open file to the end of
+    // the window, without sending it. With the file mapped, the packet just references
+    // the bytes. Returns true when done reading file.
+    bool readFileChunk();
+
+    // Let the kernel drop the pages of filemap that every packet in the window is past.
+    void releaseFile();
 };
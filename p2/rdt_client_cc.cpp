@@ -1,7 +1,8 @@
 #include "rdt_cc.h"
 
 // Creates and binds a socket to the server and port.
-Client::Client(char* serverhostname, char* port, char* filename) {
+Client::Client(char* serverhostname, char* port, char* filename, RdtOptions options) {
+    this->options = options;
     this->sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);  // Create UDP socket.
     if (this->sockfd < 0) {
         fprintf(stderr, "ERROR: Unable to open socket.\n");
@@ -21,185 +22,379 @@ Client::Client(char* serverhostname, char* port, char* filename) {
 
     // Attempt to connect to server (sending TCP handshake).
     Packet snd_packet; 
-    Packet* rcv_packet = NULL;
+    Packet rcv_packet;
     int receivestatus;
-    uint16_t nextseqno;
+    uint32_t nextseqno;
 
-    // Send SYN with initial seqno.
+    // Offer the largest packet that fits the path to the server, and make room for it.
+    int offer_size = min(this->options.max_pkt_size, pathPacketSize(this->serverinfo));
+    packet_pool().resize(offer_size);
+    uint16_t offer = offer_size;
+
+    // Send SYN with initial seqno and our packet size offer.
     srand(time(NULL));
-    nextseqno = rand() % MAX_SEQNO; // Set initial sequence number randomly.
-    snd_packet = Packet(SYN, nextseqno, 0);
+    nextseqno = initialSeqno(); // Set initial sequence number randomly.
+    snd_packet = Packet(SYN, nextseqno, 0, (uint8_t*) &offer, sizeof(offer));
 
     do {
-        delete rcv_packet; rcv_packet = NULL;
         this->sendPacket(snd_packet); // Send SYN.
         receivestatus = this->receivePacket(rcv_packet, true, TIMEOUT); // Wait for SYNACK.
-    } while (receivestatus <= 0 || (rcv_packet->header).flags != SYNACK || rcv_packet->header.ackno != snd_packet.header.seqno);
+    } while (receivestatus <= 0 || rcv_packet.header().flags != SYNACK || rcv_packet.header().ackno != snd_packet.header().seqno);
+
+    // The SYNACK carries the packet size the server picked, which is at most our offer.
+    uint16_t agreed = DEFAULT_PKT_SIZE;
+    if (rcv_packet.payloadSize() >= (int) sizeof(agreed)) {
+        memcpy(&agreed, rcv_packet.payload(), sizeof(agreed));
+    }
+    this->pkt_size = min((int) agreed, offer_size);
+    sizeSocketBuffers(this->sockfd, this->pkt_size);
 
-    uint16_t filenameseqno = (nextseqno + 1) % MAX_SEQNO;
+    uint32_t filenameseqno = nextseqno + 1;
 
     // Send ACK for SYNACK, include filename.
-    snd_packet = Packet(ACK, filenameseqno, rcv_packet->header.seqno, (uint8_t*) filename, strlen(filename) + 1);
-    this->rcv_base = (rcv_packet->header.seqno + 1) % MAX_SEQNO;
+    snd_packet = Packet(ACK, filenameseqno, rcv_packet.header().seqno, (uint8_t*) filename, strlen(filename) + 1);
+    this->rcv_window.reset(rcv_packet.header().seqno + 1, this->pkt_size - (INCHEADER? 0 : HEADER_SIZE));
     do {
-        delete rcv_packet; rcv_packet = NULL;
         this->sendPacket(snd_packet); // Send the ACK with filename.
         receivestatus = this->receivePacket(rcv_packet, true, TIMEOUT); // Wait for first ACK of filename.
-    } while (receivestatus <= 0 || rcv_packet->header.flags != ACK || rcv_packet->header.ackno != filenameseqno);
+    } while (receivestatus <= 0 || rcv_packet.header().flags != ACK || rcv_packet.header().ackno != filenameseqno);
 
     // Begin accepting requested file.
-    ofstream outputfile("received.data", ios::trunc | ios::out | ios::binary);
+    FileWriter outputfile("received.data", this->options.direct_io);
+    Packet rcv_packets[BATCH_SIZE];
+    uint32_t acks[BATCH_SIZE]; // Seqnos of the packets to ACK.
+    rcv_packets[0] = std::move(rcv_packet); // The first packet of the file came with the handshake.
+    int received = 1;
     // Accept the rest of the file.
     while(1) {
-        if (rcv_packet == NULL) {
-            receivestatus = this->receivePacket(rcv_packet, true, TIMEOUT);
-        } else if (!(rcv_packet->header.flags & FIN)) {
-            // Normal packet.
-            if (!this->isDuplicatePacket(rcv_packet)) {
-                // This block of code is here to write out-of-order packets in the correct order to file.
-                if (rcv_packet->header.seqno != this->rcv_base) {
-                    this->rcv_window.push_back(new Packet(rcv_packet)); // Add to buffer.
-                } else {
-                    // Write packet to file immediately and update rcv_base.
-                    writePacketToFile(outputfile, rcv_packet);
-                    this->rcv_base = (this->rcv_base + rcv_packet->packet_size - (INCHEADER? 0 : HEADER_SIZE)) % MAX_SEQNO;
-
-                    // Write all previously buffered and consecutively numbered (beginning with rcv_base) packets.
-                    bool removed_one;
-                    do {
-                        removed_one = false;
-                        for (vector<Packet*>::iterator it = this->rcv_window.begin(); it != this->rcv_window.end();) {
-                            if ((*it)->header.seqno == this->rcv_base) {
-                                writePacketToFile(outputfile, *it);
-                                this->rcv_base = (this->rcv_base + (*it)->packet_size - (INCHEADER? 0 : HEADER_SIZE)) % MAX_SEQNO;
-                                delete *it;
-                                this->rcv_window.erase(it);
-                                removed_one = true;
-                            } else {
-                                ++it;
-                            }
-                        }
-                    } while (removed_one);
-                }
+        if (received <= 0) {
+            int timeout = this->delayedAckTimeout();
+            received = this->receivePackets(rcv_packets, BATCH_SIZE, (timeout == NOTIMEOUT)? TIMEOUT : timeout);
+            if (received <= 0 && this->delayedAckTimeout() == 0) {
+                // Nothing else came in time: ACK what was held back.
+                int nacks = 0;
+                this->flushDelayedAck(acks, nacks);
+                this->sendAcks(acks, nacks);
             }
-            // ACK the received packet. 
-            Packet ack = Packet(ACK, 0, rcv_packet->header.seqno);
-            this->sendPacket(ack);
+            continue;
+        }
 
-            delete rcv_packet; rcv_packet = NULL;
+        // Handle the whole batch, then send its ACKs together.
+        int nacks = 0;
+        for (int i = 0; i < received; i++) {
+            Packet& rcv_packet = rcv_packets[i];
+            if (!(rcv_packet.header().flags & FIN)) {
+                // Normal packet.
+                uint32_t seqno = rcv_packet.header().seqno;
+                bool in_sequence = false;
+                if (!this->isDuplicatePacket(rcv_packet)) {
+                    in_sequence = this->rcv_window.inSequence(seqno);
+                    // Buffer the packet in its slot; it is written out once everything before it is in.
+                    // A packet we can't place isn't ACKed, so it comes again.
+                    if (!this->rcv_window.insert(std::move(rcv_packet))) {
+                        continue;
+                    }
+                }
+                // ACK the received packet, now or together with the next ones.
+                this->ackPacket(seqno, in_sequence, acks, nacks);
+            } else {
+                // Server is trying to close connection. ACK what came before the FIN, then respond with FINACK.
+                this->writeInOrder(outputfile);
+                this->flushDelayedAck(acks, nacks);
+                this->sendAcks(acks, nacks);
+                uint32_t finackseqno = filenameseqno + strlen(filename) + 1;
+                snd_packet = Packet(FINACK, finackseqno, rcv_packet.header().seqno);
+                this->sendPacket(snd_packet);
 
-        } else {
-            // Server is trying to close connection. Respond with FINACK.
-            uint16_t finackseqno = (filenameseqno + strlen(filename) + 1) % MAX_SEQNO;
-            snd_packet = Packet(FINACK, finackseqno, rcv_packet->header.seqno);
-            this->sendPacket(snd_packet);
-
-            // Wait for ACK.
-            struct timeval timedwaittimeout;
-            timeradd(&TIMEOUT, &TIMEOUT, &timedwaittimeout);
-            while (this->receivePacket(rcv_packet, true, timedwaittimeout) > 0) {
-                if (rcv_packet->header.flags != ACK)
-                    break;
-            }
-            if (rcv_packet != NULL) {
-                delete rcv_packet; rcv_packet = NULL;
-            }
+                // Wait for ACK.
+                while (this->receivePacket(rcv_packet, true, 2 * TIMEOUT) > 0) {
+                    if (rcv_packet.header().flags != ACK)
+                        break;
+                }
 
-            outputfile.close();
-            close(sockfd);
-            exit(0);
+                outputfile.close();
+                close(sockfd);
+                packet_pool().printStats(stderr);
+                fprintf(stderr, "ACKs: %lu sent, %lu saved by delaying\n", this->acks_sent, this->acks_saved);
+                exit(0);
+            }
+        }
+        this->writeInOrder(outputfile);
+        if (this->delayedAckTimeout() == 0) {
+            this->flushDelayedAck(acks, nacks);
         }
+        this->sendAcks(acks, nacks);
+        received = 0;
     }
 }
 
 // Prepares a packet to be sent.
 int Client::sendPacket(Packet &packet, bool retransmission) {
-    // Copy packet header into a buffer.
-    uint8_t* packet_buffer = new uint8_t[HEADER_SIZE + packet.packet_size];
-    memcpy(packet_buffer, &(packet.header), HEADER_SIZE);
-    
-    // Copy payload into buffer if it exists.
-    if (packet.payload != NULL && packet.packet_size > HEADER_SIZE) {
-        memcpy(&packet_buffer[HEADER_SIZE], packet.payload, packet.packet_size - HEADER_SIZE);
-    }
-
-    // Send the packet to the server.
-    int bytessent = sendto(this->sockfd, packet_buffer, packet.packet_size, 0, (struct sockaddr*) &(this->serverinfo), sizeof(this->serverinfo));
+    // Send the packet to the server. Header and payload are already together in its wire buffer.
+    int bytessent = sendto(this->sockfd, packet.buffer, packet.packet_size, 0, (struct sockaddr*) &(this->serverinfo), sizeof(this->serverinfo));
 
     if (bytessent <= 0) {
-        fprintf(stderr, "Error sending packet with ackno %d. Exiting.\n", packet.header.ackno);
+        fprintf(stderr, "Error sending packet with ackno %u. Exiting.\n", packet.header().ackno);
         exit(1);
     }
 
+    this->packetSent(packet, retransmission);
+
+    return (bytessent > 0) ? bytessent : 0;
+}
+
+// Print the status line for a packet that just went out.
+void Client::packetSent(Packet &packet, bool retransmission) {
     // Print status message.
-    if (packet.header.flags & SYN) {
+    if (packet.header().flags & SYN) {
         fprintf(stdout, "Sending packet SYN\n");
     } else {
-        const char* type = (retransmission)? "Retransmission" : (packet.header.flags & FIN)? "FIN" : "";
-        fprintf(stdout, "Sending packet %d %s\n", packet.header.ackno, type);
+        const char* type = (retransmission)? "Retransmission" : (packet.header().flags & FIN)? "FIN" : "";
+        fprintf(stdout, "Sending packet %u %s\n", packet.header().ackno, type);
     }
+}
 
-    delete packet_buffer;
-    return (bytessent > 0) ? bytessent : 0;
+// Send count packets to the server in as few syscalls as possible: up to
+// BATCH_SIZE datagrams per sendmmsg(), and with GSO each run of equal-sized packets
+// goes down as one datagram that the kernel splits back into packets.
+void Client::sendPackets(Packet* packets, int count) {
+    if (!this->options.batch_io) {
+        for (int i = 0; i < count; i++) {
+            this->sendPacket(packets[i]);
+        }
+        return;
+    }
+
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    char control[BATCH_SIZE][CMSG_SPACE(sizeof(uint16_t))];
+    int sent = 0;
+    while (sent < count) {
+        int nmsgs = 0;
+        int niovs = 0;
+        for (int i = sent; i < count && nmsgs < BATCH_SIZE && niovs < BATCH_SIZE; nmsgs++) {
+            struct msghdr* msg = &msgs[nmsgs].msg_hdr;
+            memset(msg, 0, sizeof(struct msghdr));
+            msg->msg_name = &(this->serverinfo);
+            msg->msg_namelen = sizeof(this->serverinfo);
+            msg->msg_iov = &iovs[niovs];
+
+            // A GSO run is any number of same-sized packets, optionally ending with a shorter one.
+            int segment_size = packets[i].packet_size;
+            int segments = 0;
+            int run_bytes = 0;
+            do {
+                iovs[niovs].iov_base = packets[i].buffer;
+                iovs[niovs].iov_len = packets[i].packet_size;
+                run_bytes += packets[i].packet_size;
+                segments++;
+                niovs++;
+                i++;
+            } while (this->options.gso && i < count && niovs < BATCH_SIZE && segments < GSO_MAX_SEGMENTS
+                     && packets[i - 1].packet_size == segment_size && packets[i].packet_size <= segment_size
+                     && run_bytes + packets[i].packet_size <= GSO_MAX_BYTES);
+            msg->msg_iovlen = segments;
+
+            if (segments > 1) {
+                msg->msg_control = control[nmsgs];
+                msg->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t gso_size = segment_size;
+                memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+            }
+        }
+
+        int msgssent = sendmmsg(this->sockfd, msgs, nmsgs, 0);
+        if (msgssent <= 0) {
+            if (this->options.gso && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+                // No GSO on this path, send the datagrams one by one from now on.
+                this->options.gso = false;
+                continue;
+            }
+            fprintf(stderr, "Error sending packet with ackno %u. Exiting.\n", packets[sent].header().ackno);
+            exit(1);
+        }
+        for (int m = 0; m < msgssent; m++) {
+            for (size_t j = 0; j < msgs[m].msg_hdr.msg_iovlen; j++) {
+                this->packetSent(packets[sent++], false);
+            }
+        }
+    }
 }
 
 // Set blocking to false to make this a non-blocking operation.
 // Wait for a packet and store in buffer. Returns number of bytes read on success, 0 otherwise.
-int Client::receivePacket(Packet* &packet, bool blocking, struct timeval timeout) {
-    uint8_t* buffer = new uint8_t[MAX_PKT_SIZE];
+int Client::receivePacket(Packet &packet, bool blocking, int timeout) {
+    if (blocking && !waitReadable(this->sockfd, timeout)) {
+        return -1; // Timeout occured.
+    }
+
+    uint8_t* buffer = packet_pool().get();
     socklen_t serverinfolen = sizeof(struct sockaddr);
     
-    setsockopt(this->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-    int bytesreceived = recvfrom(this->sockfd, buffer, MAX_PKT_SIZE, blocking? 0 : MSG_DONTWAIT,
+    int bytesreceived = recvfrom(this->sockfd, buffer, packet_pool().bufferSize(), MSG_DONTWAIT,
                             (struct sockaddr*) &(this->serverinfo), &serverinfolen);
 
     // Error occured (possibly a timeout).
     if (bytesreceived <= 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        int saved = errno;
+        packet_pool().put(buffer);
+        if (saved == EAGAIN || saved == EWOULDBLOCK) {
             // TODO: Set packet to NULL?
             return -1; // Timeout occured.
         } else {
             // Some other error occured.
-            fprintf(stderr, "Error sending packet with seqno %d. Exiting.\n", packet->header.seqno);
+            fprintf(stderr, "Error receiving packet: %s. Exiting.\n", strerror(saved));
             exit(1);
         }
     }
 
-    // Copy header.
-    PacketHeader header;
-    memcpy(&header, buffer, HEADER_SIZE);
-    
-    // Copy payload (it if exists) and set packet that was passed in.
-    int payload_size = bytesreceived - HEADER_SIZE;
-    if (payload_size > 0) {
-        packet = new Packet(header, &buffer[HEADER_SIZE], payload_size);
-    } else {
-        packet = new Packet(header);
-    }
+    // Hand the buffer over to the packet that was passed in.
+    packet = Packet(buffer, bytesreceived);
 
     // Print status message.
-    fprintf(stdout, "Receiving packet %d\n", packet->header.seqno);
+    fprintf(stdout, "Receiving packet %u\n", packet.header().seqno);
 
-    delete buffer;
     return bytesreceived;
 }
 
-void Client::writePacketToFile(ofstream &file, Packet* &packet) {
-    for (int i = 0; i < (packet->packet_size - HEADER_SIZE); i++) {
-        file << packet->payload[i];
+// Wait up to timeout ms for packets from the server, then take whatever else has
+// already arrived (up to max) with the same recvmmsg(). Returns the number of
+// packets stored, or -1 on timeout.
+int Client::receivePackets(Packet* packets, int max, int timeout) {
+    if (!this->options.batch_io || max == 1) {
+        return (this->receivePacket(packets[0], true, timeout) > 0)? 1 : -1;
+    }
+    if (max > BATCH_SIZE) {
+        max = BATCH_SIZE;
+    }
+    if (!waitReadable(this->sockfd, timeout)) {
+        return -1; // Timeout occured.
     }
-}
 
-bool Client::isDuplicatePacket(Packet* &packet) {
-    for (uint16_t seqno : this->last_seqnos) {
-        if (packet->header.seqno == seqno) {
-            return true;
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    uint8_t* buffers[BATCH_SIZE];
+    for (int i = 0; i < max; i++) {
+        buffers[i] = packet_pool().get();
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = packet_pool().bufferSize();
+        memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        msgs[i].msg_hdr.msg_name = &(this->serverinfo);
+        msgs[i].msg_hdr.msg_namelen = sizeof(this->serverinfo);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int received = recvmmsg(this->sockfd, msgs, max, MSG_DONTWAIT, NULL);
+    int saved = errno;
+
+    // Hand the filled buffers over to the packets, and the rest back to the pool.
+    for (int i = 0; i < max; i++) {
+        if (i < received) {
+            packets[i] = Packet(buffers[i], msgs[i].msg_len);
+            fprintf(stdout, "Receiving packet %u\n", packets[i].header().seqno);
+        } else {
+            packet_pool().put(buffers[i]);
         }
     }
-    // Not a duplicate. Add to last_seqnos.
-    this->last_seqnos.push_back(packet->header.seqno);
-    if (this->last_seqnos.size() > MAX_SEQNO/MAX_PKT_SIZE_SANS_HEADER) {
-        this->last_seqnos.erase(this->last_seqnos.begin());
+
+    if (received <= 0) {
+        if (saved == EAGAIN || saved == EWOULDBLOCK) {
+            return -1; // Timeout occured.
+        }
+        fprintf(stderr, "Error receiving packet: %s. Exiting.\n", strerror(saved));
+        exit(1);
+    }
+    return received;
+}
+
+// ACK the packets with these seqnos. Every ACK also carries the cumulative ACK
+// and the blocks waiting in rcv_window, so the server learns about all of the
+// stream from any one of them, even if the others are lost.
+void Client::sendAcks(uint32_t* seqnos, int count) {
+    SackInfo sack;
+    uint32_t starts[MAX_SACK_BLOCKS], ends[MAX_SACK_BLOCKS];
+    sack.cumackno = this->rcv_window.nextSeqno();
+    int nblocks = this->rcv_window.ranges(starts, ends, MAX_SACK_BLOCKS);
+    for (int k = 0; k < nblocks; k++) {
+        sack.blocks[k].start = starts[k];
+        sack.blocks[k].end = ends[k];
+    }
+
+    Packet acks[BATCH_SIZE];
+    for (int i = 0; i < count; i++) {
+        acks[i] = Packet(ACK | SACK, 0, seqnos[i], (uint8_t*) &sack, sackInfoSize(nblocks));
+    }
+    this->sendPackets(acks, count);
+    this->acks_sent += count;
+}
+
+// Packets that arrive in sequence are ACKed every options.ack_every of them, or
+// ACK_DELAY after the first one held back: the cumulative ackno in the SackInfo
+// covers the ones in between. Anything out of sequence (a packet beyond a gap,
+// one filling a gap, or a duplicate) is ACKed at once, so the server hears of
+// losses without delay and counts its duplicate ACKs.
+void Client::ackPacket(uint32_t seqno, bool in_sequence, uint32_t* acks, int &nacks) {
+    if (!in_sequence || this->options.ack_every <= 1) {
+        // This ACK's cumulative ackno covers the held-back packets as well.
+        this->acks_saved += this->delayed_acks;
+        this->delayed_acks = 0;
+        acks[nacks++] = seqno;
+        return;
+    }
+    if (this->delayed_acks == 0) {
+        this->ack_deadline = monotonicMicros() + ACK_DELAY * 1000;
+    }
+    this->delayed_acks++;
+    this->delayed_ackno = seqno;
+    if (this->delayed_acks >= this->options.ack_every) {
+        this->flushDelayedAck(acks, nacks);
+    }
+}
+
+// Append the ACK for the latest held-back packet, which covers all of them.
+void Client::flushDelayedAck(uint32_t* acks, int &nacks) {
+    if (this->delayed_acks > 0) {
+        acks[nacks++] = this->delayed_ackno;
+        this->acks_saved += this->delayed_acks - 1;
+        this->delayed_acks = 0;
+    }
+}
+
+// ms until the held-back ACK is due, rounded up, or NOTIMEOUT if nothing is held back.
+int Client::delayedAckTimeout() {
+    if (this->delayed_acks == 0) {
+        return NOTIMEOUT;
     }
-    return false;
-}
\ No newline at end of file
+    int64_t remaining = this->ack_deadline - monotonicMicros();
+    return (remaining > 0)? (int) ((remaining + 999) / 1000) : 0;
+}
+
+// Write every packet that is now in order to file, WRITE_BATCH at a time with one
+// writev() straight out of the packets' buffers, then hand the buffers back.
+void Client::writeInOrder(FileWriter &file) {
+    struct iovec iovs[WRITE_BATCH];
+    while (1) {
+        int count = 0;
+        for (Packet* packet = this->rcv_window.at(0); packet != NULL && count < WRITE_BATCH; packet = this->rcv_window.at(count)) {
+            iovs[count].iov_base = packet->payload();
+            iovs[count].iov_len = packet->payloadSize();
+            count++;
+        }
+        if (count == 0) {
+            return;
+        }
+        file.write(iovs, count);
+        for (int i = 0; i < count; i++) {
+            this->rcv_window.pop_front(iovs[i].iov_len + (INCHEADER? HEADER_SIZE : 0));
+        }
+    }
+}
+
+bool Client::isDuplicatePacket(Packet &packet) {
+    return this->rcv_window.contains(packet.header().seqno);
+}
@@ -1,7 +1,8 @@
 #include "rdt.h"
 
 // Creates and binds a socket to the server port.
-Server::Server(char* src_port) {
+Server::Server(char* src_port, RdtOptions options) {
+    this->options = options;
     this->sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);  // Create UDP socket.
     if (this->sockfd < 0) {
         fprintf(stderr, "ERROR: Unable to open socket.");
@@ -28,250 +29,538 @@ Server::Server(char* src_port) {
     }
 
     Packet snd_packet;
-    Packet* rcv_packet = NULL;
+    Packet rcv_packet;
     int receivestatus;
 
     // Listen for TCP connection by waiting for SYN.
     do {
         receivestatus = this->receivePacket(rcv_packet);
-    } while (receivestatus <= 0 || (rcv_packet->header).flags != SYN);
+    } while (receivestatus <= 0 || rcv_packet.header().flags != SYN);
+
+    // Settle on a packet size: the client's offer from the SYN, our own limit or
+    // the path MTU, whichever is smallest. A SYN without an offer gets the default;
+    // one offering less than MIN_PKT_SIZE, too little to carry data, is refused.
+    uint16_t offer = DEFAULT_PKT_SIZE;
+    if (rcv_packet.payloadSize() >= (int) sizeof(offer)) {
+        memcpy(&offer, rcv_packet.payload(), sizeof(offer));
+    }
+    if (offer < MIN_PKT_SIZE) {
+        fprintf(stderr, "Client offered %u-byte packets, less than the %d-byte minimum. Exiting.\n", offer, MIN_PKT_SIZE);
+        exit(1);
+    }
+    this->pkt_size = min(min((int) offer, this->options.max_pkt_size), pathPacketSize(this->clientinfo));
 
-    // Send SYNACK with random initial seqno, and wait for ACK.
+    // Every buffer from here on must hold a full packet.
+    uint32_t synseqno = rcv_packet.header().seqno;
+    rcv_packet = Packet();
+    if (!packet_pool().resize(this->pkt_size)) {
+        fprintf(stderr, "Unable to resize packet buffers.\n");
+        exit(1);
+    }
+    sizeSocketBuffers(this->sockfd, this->pkt_size);
+    this->window.setSeqnoStep(this->pkt_size - (INCHEADER? 0 : HEADER_SIZE));
+
+    // Send SYNACK with random initial seqno and the packet size, and wait for ACK.
     srand(time(NULL));
-    this->nextseqno = rand() % MAX_SEQNO; // Set initial sequence number randomly.
-    snd_packet = Packet(SYNACK, this->nextseqno, rcv_packet->header.seqno);
-    this->nextseqno = (this->nextseqno + 1) % MAX_SEQNO;
+    this->nextseqno = initialSeqno(); // Set initial sequence number randomly.
+    uint16_t agreed = this->pkt_size;
+    snd_packet = Packet(SYNACK, this->nextseqno, synseqno, (uint8_t*) &agreed, sizeof(agreed));
+    this->nextseqno++;
     do {
-        delete rcv_packet; rcv_packet = NULL;
         this->sendPacket(snd_packet);
         receivestatus = this->receivePacket(rcv_packet, true, TIMEOUT);
-    } while (receivestatus <= 0 || (rcv_packet->header).flags != ACK || rcv_packet->header.ackno != snd_packet.header.seqno);
+    } while (receivestatus <= 0 || rcv_packet.header().flags != ACK || rcv_packet.header().ackno != snd_packet.header().seqno);
 
-    this->filename_ackno = rcv_packet->header.seqno; // Record filename SEQNO for ACKing.
+    this->filename_ackno = rcv_packet.header().seqno; // Record filename SEQNO for ACKing.
 
-    if (rcv_packet->payload == NULL) {
+    if (rcv_packet.payloadSize() <= 0) {
         fprintf(stderr, "Error receiving ACK. No filename included.\n");
         exit(1);
     }
 
     // Connection has been established. Send requested file to client.
-    if (this->sendFile((char*) rcv_packet->payload) <= 0) {
+    if (this->sendFile((char*) rcv_packet.payload()) <= 0) {
         fprintf(stderr, "Error sending file to client.\n");
         exit(1);
     }
-    delete rcv_packet; rcv_packet = NULL;
 
     // Send FIN, then wait for FINACK.
     snd_packet = Packet(FIN, this->nextseqno);
     do {
-        if (rcv_packet == NULL) 
-            delete rcv_packet;
         this->sendPacket(snd_packet);
-    } while (this->receivePacket(rcv_packet, true, TIMEOUT) <= 0 || rcv_packet->header.flags != FINACK);
+    } while (this->receivePacket(rcv_packet, true, this->rtoMillis()) <= 0 || rcv_packet.header().flags != FINACK);
 
     // Send ACK for FINACK, then close connection.
-    snd_packet = Packet(ACK, this->nextseqno, rcv_packet->header.seqno);
+    snd_packet = Packet(ACK, this->nextseqno, rcv_packet.header().seqno);
     this->sendPacket(snd_packet);
 
     fprintf(stdout, "Closing connection. Goodbye.\n");
+    packet_pool().printStats(stderr);
+    header_pool().printStats(stderr, "Header pool");
+    fprintf(stderr, "Sent %lu packets, %lu of them retransmissions\n", this->packets_sent, this->retransmissions);
     close(this->sockfd);
     exit(0);
 }
 
 // Send a packet to the connected client. Returns bytes sent on success, 0 otherwise.
 int Server::sendPacket(Packet &packet, bool retransmission) {
-    // Copy packet header into a buffer.
-    uint8_t* packet_buffer = new uint8_t[HEADER_SIZE + packet.packet_size];
-    memcpy(packet_buffer, &packet.header, HEADER_SIZE);
-
-    // Copy payload into buffer if it exists.
-    if (packet.payload != NULL && packet.packet_size > HEADER_SIZE) {
-        memcpy(&packet_buffer[HEADER_SIZE], packet.payload, packet.packet_size - HEADER_SIZE);
-    }
-
-    // Send the packet to the client.
-    int bytessent = sendto(this->sockfd, packet_buffer, packet.packet_size, 0, (struct sockaddr*) &(this->clientinfo), sizeof(this->clientinfo));
+    // Send the packet to the client, gathering the payload from the file mapping if it references it.
+    struct iovec iov[2];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &(this->clientinfo);
+    msg.msg_namelen = sizeof(this->clientinfo);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = packet.wireIovec(iov);
+    int bytessent = sendmsg(this->sockfd, &msg, 0);
 
     if (bytessent <= 0) {
-        fprintf(stderr, "Error sending packet with seqno %d. Exiting.\n", packet.header.seqno);
+        fprintf(stderr, "Error sending packet with seqno %u. Exiting.\n", packet.header().seqno);
         exit(1);
     }
 
+    this->packetSent(packet, retransmission);
+    return (bytessent > 0) ? bytessent : 0;
+}
+
+// Restart the packet's timer and print its status line once it has gone out.
+void Server::packetSent(Packet &packet, bool retransmission) {
     // Reset timeout on packet.
-    struct timeval timeofday;
-    gettimeofday(&timeofday, NULL);
-    timeradd(&TIMEOUT, &timeofday, &(packet.timeout_time));
+    packet.sent_time = monotonicMicros();
+    packet.timeout_time = packet.sent_time + this->rto;
+    packet.retransmitted |= retransmission;
+    this->timers.push(Deadline(packet.timeout_time, packet.header().seqno));
+    this->packets_sent++;
+    if (retransmission) {
+        this->retransmissions++;
+    }
 
     // Print status message.
-    const char* type = (retransmission)? "Retransmission" : (packet.header.flags & SYN)? "SYN" : (packet.header.flags & FIN)? "FIN" : "";
-    fprintf(stdout, "Sending packet %d %d %s\n", packet.header.seqno, this->cwnd * MAX_PKT_SIZE, type);
+    const char* type = (retransmission)? "Retransmission" : (packet.header().flags & SYN)? "SYN" : (packet.header().flags & FIN)? "FIN" : "";
+    fprintf(stdout, "Sending packet %u %d %s\n", packet.header().seqno, this->cwnd * this->pkt_size, type);
 
-    delete packet_buffer;
-    return (bytessent > 0) ? bytessent : 0;
+}
+
+// Send count packets to the connected client in as few syscalls as possible: up to
+// BATCH_SIZE datagrams per sendmmsg(), and with GSO each run of equal-sized packets
+// goes down as one datagram that the kernel splits back into packets.
+void Server::sendPackets(Packet* packets, int count, bool retransmission) {
+    if (!this->options.batch_io) {
+        for (int i = 0; i < count; i++) {
+            this->sendPacket(packets[i], retransmission);
+        }
+        return;
+    }
+
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[2 * BATCH_SIZE]; // Up to two per packet: header, then referenced payload.
+    int msgpackets[BATCH_SIZE]; // Packets carried by each message.
+    char control[BATCH_SIZE][CMSG_SPACE(sizeof(uint16_t))];
+    int sent = 0;
+    while (sent < count) {
+        int nmsgs = 0;
+        int niovs = 0;
+        for (int i = sent; i < count && nmsgs < BATCH_SIZE && niovs + 2 <= 2 * BATCH_SIZE; nmsgs++) {
+            struct msghdr* msg = &msgs[nmsgs].msg_hdr;
+            memset(msg, 0, sizeof(struct msghdr));
+            msg->msg_name = &(this->clientinfo);
+            msg->msg_namelen = sizeof(this->clientinfo);
+            msg->msg_iov = &iovs[niovs];
+
+            // A GSO run is any number of same-sized packets, optionally ending with a shorter one.
+            int segment_size = packets[i].packet_size;
+            int segments = 0;
+            int run_bytes = 0;
+            int run_iovs = 0;
+            do {
+                run_iovs += packets[i].wireIovec(&iovs[niovs + run_iovs]);
+                run_bytes += packets[i].packet_size;
+                segments++;
+                i++;
+            } while (this->options.gso && i < count && niovs + run_iovs + 2 <= 2 * BATCH_SIZE && segments < GSO_MAX_SEGMENTS
+                     && packets[i - 1].packet_size == segment_size && packets[i].packet_size <= segment_size
+                     && run_bytes + packets[i].packet_size <= GSO_MAX_BYTES);
+            msg->msg_iovlen = run_iovs;
+            niovs += run_iovs;
+            msgpackets[nmsgs] = segments;
+
+            if (segments > 1) {
+                msg->msg_control = control[nmsgs];
+                msg->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+                struct cmsghdr* cmsg = CMSG_FIRSTHDR(msg);
+                cmsg->cmsg_level = SOL_UDP;
+                cmsg->cmsg_type = UDP_SEGMENT;
+                cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t gso_size = segment_size;
+                memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+            }
+        }
+
+        int msgssent = sendmmsg(this->sockfd, msgs, nmsgs, 0);
+        if (msgssent <= 0) {
+            if (this->options.gso && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+                // No GSO on this path, send the datagrams one by one from now on.
+                this->options.gso = false;
+                continue;
+            }
+            fprintf(stderr, "Error sending packet with seqno %u. Exiting.\n", packets[sent].header().seqno);
+            exit(1);
+        }
+        for (int m = 0; m < msgssent; m++) {
+            for (int j = 0; j < msgpackets[m]; j++) {
+                this->packetSent(packets[sent++], retransmission);
+            }
+        }
+    }
+}
+
+// Send window[from, to), in one batch unless the window's ring wraps in between.
+void Server::sendWindow(size_t from, size_t to, bool retransmission) {
+    while (from < to) {
+        size_t run = min(to - from, this->window.contiguous(from));
+        this->sendPackets(&this->window[from], run, retransmission);
+        from += run;
+    }
 }
 
 // Set blocking to false to make this a non-blocking operation.
 // Wait for a packet from a client and store in buffer. Returns number of bytes read on success, 0 otherwise.
-int Server::receivePacket(Packet* &packet, bool blocking, struct timeval timeout) {
-    uint8_t* buffer = new uint8_t[MAX_PKT_SIZE];
+int Server::receivePacket(Packet &packet, bool blocking, int timeout) {
+    if (blocking && !waitReadable(this->sockfd, timeout)) {
+        return -1; // Timeout occured.
+    }
+
+    uint8_t* buffer = packet_pool().get();
     socklen_t clientinfolen = sizeof(this->clientinfo);
     
-    setsockopt(this->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-    int bytesreceived = recvfrom(this->sockfd, buffer, MAX_PKT_SIZE, blocking? 0 : MSG_DONTWAIT,
+    int bytesreceived = recvfrom(this->sockfd, buffer, packet_pool().bufferSize(), MSG_DONTWAIT,
                             (struct sockaddr*) &(this->clientinfo), &clientinfolen);
 
     // Error occured (possibly a timeout).
     if (bytesreceived <= 0) {
-        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        int saved = errno;
+        packet_pool().put(buffer);
+        if (saved == EAGAIN || saved == EWOULDBLOCK) {
             // TODO: Set packet to NULL?
             return -1; // Timeout occured.
         } else {
             // Some other error occured.
-            fprintf(stderr, "Error sending packet with ackno %d. Exiting.\n", packet->header.ackno);
+            fprintf(stderr, "Error receiving packet: %s. Exiting.\n", strerror(saved));
             exit(1);
         }
     }
 
-    // Copy header.
-    PacketHeader header;
-    memcpy(&header, buffer, HEADER_SIZE);
-    
-    // Copy payload (it if exists) and set packet that was passed in.
-    int payload_size = bytesreceived - HEADER_SIZE;
-    if (payload_size > 0) {
-        packet = new Packet(header, &buffer[HEADER_SIZE], payload_size);
-    } else {
-        packet = new Packet(header);
-    }
+    // Hand the buffer over to the packet that was passed in.
+    packet = Packet(buffer, bytesreceived);
 
     // Print status message.
-    fprintf(stdout, "Receiving packet %d\n", packet->header.ackno);
+    fprintf(stdout, "Receiving packet %u\n", packet.header().ackno);
 
-    delete buffer;
     return bytesreceived;
 }
 
-// Reads the next MAX_PKT_SIZE_SANS_HEADER bytes from the open file, then
-// creates a packet with the data read from the file, and sends it.
-// Returns true when done reading file.
-bool Server::sendFileChunk() {
-    // Allocate space for buffer.
-    uint8_t* buffer = new uint8_t[MAX_PKT_SIZE_SANS_HEADER];
-    memset(buffer, '\0', MAX_PKT_SIZE_SANS_HEADER);
+// Wait up to timeout ms for packets from the client, then take whatever else has
+// already arrived (up to max) with the same recvmmsg(). Returns the number of
+// packets stored, or -1 on timeout.
+int Server::receivePackets(Packet* packets, int max, int timeout) {
+    if (!this->options.batch_io || max == 1) {
+        return (this->receivePacket(packets[0], true, timeout) > 0)? 1 : -1;
+    }
+    if (max > BATCH_SIZE) {
+        max = BATCH_SIZE;
+    }
+    if (!waitReadable(this->sockfd, timeout)) {
+        return -1; // Timeout occured.
+    }
+
+    struct mmsghdr msgs[BATCH_SIZE];
+    struct iovec iovs[BATCH_SIZE];
+    uint8_t* buffers[BATCH_SIZE];
+    for (int i = 0; i < max; i++) {
+        buffers[i] = packet_pool().get();
+        iovs[i].iov_base = buffers[i];
+        iovs[i].iov_len = packet_pool().bufferSize();
+        memset(&msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+        msgs[i].msg_hdr.msg_name = &(this->clientinfo);
+        msgs[i].msg_hdr.msg_namelen = sizeof(this->clientinfo);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int received = recvmmsg(this->sockfd, msgs, max, MSG_DONTWAIT, NULL);
+    int saved = errno;
+
+    // Hand the filled buffers over to the packets, and the rest back to the pool.
+    for (int i = 0; i < max; i++) {
+        if (i < received) {
+            packets[i] = Packet(buffers[i], msgs[i].msg_len);
+            fprintf(stdout, "Receiving packet %u\n", packets[i].header().ackno);
+        } else {
+            packet_pool().put(buffers[i]);
+        }
+    }
+
+    if (received <= 0) {
+        if (saved == EAGAIN || saved == EWOULDBLOCK) {
+            return -1; // Timeout occured.
+        }
+        fprintf(stderr, "Error receiving packet: %s. Exiting.\n", strerror(saved));
+        exit(1);
+    }
+    return received;
+}
+
+// The unACKed packet that times out first. Stale deadlines on top of the heap,
+// left by packets that have since been ACKed or resent, are dropped on the way.
+Packet* Server::nextTimeout() {
+    while (!this->timers.empty()) {
+        const Deadline& deadline = this->timers.top();
+        Packet* packet = this->window.find(deadline.second);
+        if (packet != NULL && !packet->acked && packet->timeout_time == deadline.first) {
+            if (!this->isSacked(*packet)) {
+                return packet;
+            }
+            packet->acked = true; // The client has it, so don't resend it.
+        }
+        this->timers.pop();
+    }
+    return NULL;
+}
+
+// Mark a packet in the window ACKed. Only packets sent once give a round-trip
+// sample: the ACK of a retransmitted one could be for either copy (Karn's rule).
+int64_t Server::packetAcked(Packet &packet) {
+    if (packet.acked) {
+        return 0;
+    }
+    packet.acked = true;
+    if (packet.retransmitted) {
+        return 0;
+    }
+    int64_t rtt = monotonicMicros() - packet.sent_time;
+    this->rttSample(rtt);
+    return rtt;
+}
+
+// Jacobson/Karels estimation (RFC 6298): SRTT and RTTVAR are moving averages with
+// gains 1/8 and 1/4, and RTO = SRTT + 4 * RTTVAR, clamped to [MIN_RTO, MAX_RTO].
+void Server::rttSample(int64_t rtt) {
+    if (this->srtt == 0) {
+        this->srtt = max(rtt, (int64_t) 1);
+        this->rttvar = rtt / 2;
+    } else {
+        int64_t delta = rtt - this->srtt;
+        this->rttvar += ((delta < 0? -delta : delta) - this->rttvar) / 4;
+        this->srtt += delta / 8;
+    }
+    this->rto = min(max(this->srtt + 4 * this->rttvar, (int64_t) MIN_RTO * 1000), (int64_t) MAX_RTO * 1000);
+}
+
+// Exponential backoff: each timeout doubles rto, up to MAX_RTO. The next clean
+// round-trip sample brings it back down.
+void Server::backoff() {
+    this->rto = min(this->rto * 2, (int64_t) MAX_RTO * 1000);
+    this->backoff_time = monotonicMicros();
+}
+
+// Take in the SACK state an ACK carries: the cumulative ACK, which only ever
+// moves forward, and the blocks beyond it, which replace the previous ones.
+// A duplicate ACK still brings new blocks: they say which holes remain.
+// Returns true if the cumulative ACK moved on.
+bool Server::readSack(Packet &ack) {
+    if (!(ack.header().flags & SACK) || ack.payloadSize() < sackInfoSize(0)) {
+        return false;
+    }
+    SackInfo sack;
+    memcpy(&sack, ack.payload(), min(ack.payloadSize(), (int) sizeof(sack)));
+    if (seqBefore(sack.cumackno, this->lastackno)) {
+        return false; // Older than what we know already.
+    }
+    bool moved = sack.cumackno != this->lastackno;
+    this->lastackno = sack.cumackno;
+    this->nsacked = min((ack.payloadSize() - sackInfoSize(0)) / (int) sizeof(SackBlock), MAX_SACK_BLOCKS);
+    memcpy(this->sacked, sack.blocks, this->nsacked * sizeof(SackBlock));
+    return moved;
+}
+
+// Has the client got this packet? Either it was ACKed, or it is before the
+// cumulative ACK, or inside one of the latest SACK blocks.
+bool Server::isSacked(Packet &packet) {
+    uint32_t seqno = packet.header().seqno;
+    if (packet.acked || seqBefore(seqno, this->lastackno)) {
+        return true;
+    }
+    for (int k = 0; k < this->nsacked; k++) {
+        if (!seqBefore(seqno, this->sacked[k].start) && seqBefore(seqno, this->sacked[k].end)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Slide the window past every packet at its front that the client has got, and update baseseqno.
+void Server::slideWindow() {
+    while (!this->window.empty() && (this->window.front().acked || seqBefore(this->window.front().header().seqno, this->lastackno))) {
+        this->baseseqno += this->window.front().packet_size - (INCHEADER? 0 : HEADER_SIZE);
+        this->window.pop_front();
+    }
+}
 
+// Adds a packet for the next packet's worth of the open file to the end of the
+// window. The caller sends it, together with the rest of the packets it queues.
+// Returns true when done reading file.
+bool Server::readFileChunk() {
     bool done_reading = false;
-    ssize_t bytestoread = this->filesize - this->file.tellg();
+    ssize_t bytestoread = this->filesize - this->fileoffset;
 
     int flag = (this->filename_acked)? 0 : ACK;
     int ackno = (this->filename_acked)? 0 : this->filename_ackno;
 
-    if (bytestoread > MAX_PKT_SIZE_SANS_HEADER) {
-        bytestoread = MAX_PKT_SIZE_SANS_HEADER;
+    if (bytestoread > this->pkt_size - HEADER_SIZE) {
+        bytestoread = this->pkt_size - HEADER_SIZE;
     } else {
         done_reading = true;
         // TODO: Not sure if we're supposed to send FIN with final packet of file or not. Ask TA.
         // flag = FIN; // We've come to the last chunk of the file. Send a FIN.
     }
 
-    this->file.read((char*) buffer, bytestoread);
-    Packet* packet = new Packet(flag, this->nextseqno, ackno, buffer, bytestoread);
+    Packet packet;
+    if (this->filemap != NULL) {
+        // Nothing is copied: the packet points into the mapping, and every (re)send gathers from there.
+        packet = Packet::referencing(flag, this->nextseqno, ackno, this->filemap + this->fileoffset, bytestoread);
+    } else {
+        // The chunk is read straight into its wire buffer, behind the header.
+        packet = Packet(flag, this->nextseqno, ackno, NULL, bytestoread);
+        ssize_t bytesread = pread(this->filefd, packet.payload(), bytestoread, this->fileoffset);
+        if (bytesread != bytestoread) {
+            fprintf(stderr, "Error reading file at offset %lld. Exiting.\n", (long long) this->fileoffset);
+            exit(1);
+        }
+    }
+    this->fileoffset += bytestoread;
 
-    this->sendPacket(*packet); // Send as soon as it is made available.
     if (this->window.empty()) {
-        this->baseseqno = packet->header.seqno;
+        this->baseseqno = packet.header().seqno;
     }
-    this->window.push_back(packet);
+    this->window.push_back(std::move(packet));
 
-    this->nextseqno = (this->nextseqno + bytestoread + (INCHEADER? HEADER_SIZE : 0)) % MAX_SEQNO;
+    this->nextseqno += bytestoread + (INCHEADER? HEADER_SIZE : 0);
 
-    delete buffer;
     return done_reading;
 }
 
+// Let the kernel drop the pages of filemap that every packet in the window is
+// past, RELEASE_STEP bytes at a time, so a big file never stays resident. The
+// mapping itself stays valid: pages are read back in if they are touched again.
+void Server::releaseFile() {
+    if (this->filemap == NULL) {
+        return;
+    }
+    off_t done = this->window.empty()? this->fileoffset : this->window.front().payload_ref - this->filemap;
+    off_t end = done / RELEASE_STEP * RELEASE_STEP;
+    if (end > this->filereleased) {
+        madvise((void*) (this->filemap + this->filereleased), end - this->filereleased, MADV_DONTNEED);
+        this->filereleased = end;
+    }
+}
+
 // Reliable data transfer. Contains event loop.
 int Server::sendFile(char* filename) {
     // Open specified file.
-    this->file.open(filename, ios::in | ios::binary);
-    if (!this->file || !this->file.is_open()) {
+    this->filefd = open(filename, O_RDONLY);
+    if (this->filefd < 0) {
         fprintf(stderr, "Error opening file. Error: %d\n", errno);
         exit(1);
     }
 
     // Determine filesize.
-    this->file.seekg(0, this->file.end);
-    this->filesize = this->file.tellg();
-    this->file.seekg(0, this->file.beg);
+    struct stat st;
+    if (fstat(this->filefd, &st) < 0) {
+        fprintf(stderr, "Error opening file. Error: %d\n", errno);
+        exit(1);
+    }
+    this->filesize = st.st_size;
+
+    // Map the file so packets can send straight from the page cache. Files that
+    // can't be mapped (empty ones, pipes) are pread() a chunk at a time instead.
+    if (this->filesize > 0) {
+        void* map = mmap(NULL, this->filesize, PROT_READ, MAP_SHARED, this->filefd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, this->filesize, MADV_SEQUENTIAL);
+            this->filemap = (const uint8_t*) map;
+        }
+    }
+
+    this->lastackno = this->nextseqno; // Nothing of the file has arrived yet.
 
     // Begin sending file packet by packet. Send FIN when done.
     bool done_reading = false;
-    struct timeval current_time;
-    struct timeval closest_timeout;
-    struct timeval packet_timeout;
-    struct timeval double_timeout;
-    timeradd(&TIMEOUT, &TIMEOUT, &double_timeout);
+    int closest_timeout;
     Packet* closest_packet;
-    Packet* rcv_packet = NULL;
+    Packet rcv_packets[BATCH_SIZE];
     // Event loop.
-    // Each loop, window is filled, and either one packet is received, or a timeout occurs.
+    // Each loop, window is filled, and either a batch of packets is received, or a timeout occurs.
     while (1) {
-        // Fill cwnd.
+        // Fill cwnd, then send everything new in one go.
+        size_t first_unsent = this->window.size();
         while (!done_reading && this->window.size() < this->cwnd) {
-            done_reading = (done_reading)? done_reading : this->sendFileChunk();
+            done_reading = (done_reading)? done_reading : this->readFileChunk();
         }
-
-        // Find closest timeout time in the window.
-        gettimeofday(&current_time, NULL);
-        closest_timeout = TIMEOUT;//double_timeout;
-        closest_packet = NULL;
-        for (Packet* packet : this->window) {
-            if (!packet->acked) {
-                timersub(&(packet->timeout_time), &current_time, &packet_timeout);
-                if (timercmp(&packet_timeout, &closest_timeout, <)) {
-                    closest_timeout = packet_timeout;
-                    closest_packet = packet;
-                }
-            }
+        this->sendWindow(first_unsent, this->window.size());
+
+        // Find closest timeout time in the window, rounded up to whole ms.
+        closest_timeout = this->rtoMillis();
+        closest_packet = this->nextTimeout();
+        if (closest_packet != NULL) {
+            int64_t remaining = closest_packet->timeout_time - monotonicMicros();
+            closest_timeout = (remaining > 0)? (int) ((remaining + 999) / 1000) : 0;
         }
 
         // Wait for an ACK, or a timeout. Retransmit on timeout.
         if (!this->window.empty()) {
-            if (this->receivePacket(rcv_packet, true, closest_timeout) == -1) {
+            int received = this->receivePackets(rcv_packets, BATCH_SIZE, closest_timeout);
+            if (received == -1) {
                 // Timeout occured. Retransmit the packet.
                 if (closest_packet != NULL) {
+                    // Back off only when the oldest packet times out, as TCP's one timer
+                    // would: the packets sent after it expiring too is the same loss. So
+                    // is one sent before the last backoff reaching the front and expiring.
+                    if (closest_packet == &this->window.front() && closest_packet->sent_time >= this->backoff_time) {
+                        this->backoff();
+                    }
                     this->sendPacket(*closest_packet, true);
                 }
-            } else {
-                // ACK received.
-                // Mark appropriate packet as ACKed.
-                for (Packet* packet : this->window) {
-                    if (packet->header.seqno == rcv_packet->header.ackno) {
-                        packet->acked = true;
+            }
+
+            // Handle every ACK that arrived together.
+            for (int i = 0; i < received; i++) {
+                Packet& rcv_packet = rcv_packets[i];
+                this->readSack(rcv_packet);
+                // Mark the packet this ACK is for. One for a packet that has already left
+                // the window, e.g. a retransmitted one, only brings SACK state.
+                if (!seqBefore(rcv_packet.header().ackno, this->baseseqno)) {
+                    Packet* acked = this->window.find(rcv_packet.header().ackno);
+                    if (acked != NULL) {
+                        this->packetAcked(*acked);
                     }
                 }
-                // If ACKno == baseseqno, delete all ACKed packets from beginning of window to first unACKed packet, and update baseseqno.
-                bool removed_one;
-                do {
-                    removed_one = false;
-                    for (vector<Packet*>::iterator it = this->window.begin(); it != this->window.end();) {
-                        if ((*it)->acked && (*it)->header.seqno == this->baseseqno) {
-                            this->baseseqno = (this->baseseqno + (*it)->packet_size - (INCHEADER? 0 : HEADER_SIZE)) % MAX_SEQNO;
-                            delete *it;
-                            this->window.erase(it);
-                            removed_one = true;
-                            break;
-                        } else {
-                            ++it;
-                        }
-                    }
-                } while (removed_one);
+                this->slideWindow();
 
                 this->filename_acked = true;
             }
+            this->releaseFile();
         } else if (done_reading) {
             break; // Done transmitting file.
         } else {
             fprintf(stderr, "Shouldn't be here.");
         }
     }
+
+    if (this->filemap != NULL) {
+        munmap((void*) this->filemap, this->filesize);
+        this->filemap = NULL;
+    }
+    close(this->filefd);
+    this->filefd = -1;
     return 1;
 }
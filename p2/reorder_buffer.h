@@ -0,0 +1,165 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+// The receiver's reassembly buffer: packets that arrived ahead of a gap, each in
+// the slot (seqno - base) / seqno_step of a ring, with a bitmap of which slots
+// are filled. Spotting a duplicate, storing a packet and handing back the next
+// in-order one are all O(1), however far ahead packets arrive. Every packet but
+// the last must take up exactly seqno_step bytes of sequence space.
+//
+// P is the packet type: it must be movable and default-constructible, and have
+// header().seqno.
+template <class P>
+class ReorderBuffer {
+public:
+    // Packets more than this many slots ahead of base are refused.
+    static const size_t MAX_SLOTS = 1 << 20;
+
+    explicit ReorderBuffer(uint32_t seqno_step = 1) : slots(64), filled(1) {
+        this->seqno_step = seqno_step;
+    }
+
+    // Start over expecting base next, with packets seqno_step bytes apart.
+    void reset(uint32_t base, uint32_t seqno_step) {
+        for (P& packet : this->slots) {
+            packet = P();
+        }
+        this->filled.assign(this->filled.size(), 0);
+        this->head = 0;
+        this->span = 0;
+        this->ready = 0;
+        this->base = base;
+        this->seqno_step = seqno_step;
+    }
+
+    // The next in-order sequence number: everything before it has been handed out.
+    uint32_t nextSeqno() const { return this->base; }
+
+    // Has the packet with this seqno already been handed out, or is it waiting here?
+    bool contains(uint32_t seqno) const {
+        uint32_t offset = seqno - this->base;
+        if ((int32_t) offset < 0) {
+            return true; // Before base, so delivered already.
+        }
+        size_t i = offset / this->seqno_step;
+        return offset % this->seqno_step == 0 && i < this->slots.size() && this->isFilled(this->slot(i));
+    }
+
+    // Is seqno the next one in order, with nothing waiting beyond a gap? That is
+    // the steady state; any other arrival means loss or reordering.
+    bool inSequence(uint32_t seqno) const {
+        return seqno == this->base + this->ready * this->seqno_step && this->span == this->ready;
+    }
+
+    // Store a packet that isn't a duplicate. Returns false, leaving the packet
+    // alone, if its seqno doesn't fall on a slot or is too far ahead.
+    bool insert(P&& packet) {
+        uint32_t offset = packet.header().seqno - this->base;
+        size_t i = offset / this->seqno_step;
+        if ((int32_t) offset < 0 || offset % this->seqno_step != 0 || i >= MAX_SLOTS) {
+            return false;
+        }
+        while (i >= this->slots.size()) {
+            this->grow();
+        }
+        size_t s = this->slot(i);
+        this->slots[s] = std::move(packet);
+        this->filled[s / 64] |= (uint64_t) 1 << (s % 64);
+        if (i >= this->span) {
+            this->span = i + 1;
+        }
+        while (this->ready < this->span && this->isFilled(this->slot(this->ready))) {
+            this->ready++;
+        }
+        return true;
+    }
+
+    // The packet at base, if it has arrived, or NULL.
+    P* front() {
+        return this->isFilled(this->head)? &this->slots[this->head] : NULL;
+    }
+
+    // The packet i slots after base, if it has arrived, or NULL.
+    P* at(size_t i) {
+        if (i >= this->slots.size() || !this->isFilled(this->slot(i))) {
+            return NULL;
+        }
+        return &this->slots[this->slot(i)];
+    }
+
+    // Drop the packet returned by front() and move base past the length bytes
+    // of sequence space it takes up (less than seqno_step only for the last one).
+    void pop_front(uint32_t length) {
+        this->slots[this->head] = P(); // Hands its buffer back.
+        this->base += length;
+        this->filled[this->head / 64] &= ~((uint64_t) 1 << (this->head % 64));
+        this->head = (this->head + 1) & (this->slots.size() - 1);
+        if (this->span > 0) {
+            this->span--;
+        }
+        if (this->ready > 0) {
+            this->ready--;
+        }
+    }
+
+    // The runs of packets waiting here, nearest first, as ranges of sequence space
+    // [starts[k], ends[k]), counting every packet as seqno_step long. Fills in at
+    // most max of them and returns how many.
+    int ranges(uint32_t* starts, uint32_t* ends, int max) const {
+        int n = 0;
+        size_t i = 0;
+        while (i < this->span && n < max) {
+            size_t s = this->slot(i);
+            if (s % 64 == 0 && this->filled[s / 64] == 0) {
+                i += 64; // A whole empty word of the bitmap.
+                continue;
+            }
+            if (!this->isFilled(s)) {
+                i++;
+                continue;
+            }
+            size_t j = i + 1;
+            while (j < this->span && this->isFilled(this->slot(j))) {
+                j++;
+            }
+            starts[n] = this->base + i * this->seqno_step;
+            ends[n] = this->base + j * this->seqno_step;
+            n++;
+            i = j;
+        }
+        return n;
+    }
+
+private:
+    std::vector<P> slots;          // Size is always a power of two, at least 64.
+    std::vector<uint64_t> filled;  // One bit per slot.
+    size_t head = 0;               // Slot for the packet at base.
+    size_t span = 0;               // One past the furthest slot from base that has been filled.
+    size_t ready = 0;              // Filled slots in a row from base, i.e. packets now in order.
+    uint32_t base = 0;
+    uint32_t seqno_step;
+
+    size_t slot(size_t i) const { return (this->head + i) & (this->slots.size() - 1); }
+    bool isFilled(size_t s) const { return (this->filled[s / 64] >> (s % 64)) & 1; }
+
+    // Double the ring, moving the packets to its start in order.
+    void grow() {
+        size_t n = this->slots.size();
+        std::vector<P> bigger(n * 2);
+        std::vector<uint64_t> bigger_filled(n * 2 / 64, 0);
+        for (size_t i = 0; i < n; i++) {
+            size_t s = this->slot(i);
+            if (this->isFilled(s)) {
+                bigger[i] = std::move(this->slots[s]);
+                bigger_filled[i / 64] |= (uint64_t) 1 << (i % 64);
+            }
+        }
+        this->slots.swap(bigger);
+        this->filled.swap(bigger_filled);
+        this->head = 0;
+    }
+};
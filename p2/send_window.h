@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <utility>
+#include <vector>
+
+// The sender's window: packets queued or sent but not yet ACKed, oldest first.
+// They sit in a ring indexed by sequence number, so finding the packet an ACK is
+// for and sliding the window past ACKed packets take O(1) however big the window
+// gets. Every packet except the newest must take up exactly seqno_step bytes of
+// sequence space, which holds for a file cut into full-sized packets.
+//
+// P is the packet type: it must be movable and default-constructible, and have
+// header().seqno.
+template <class P>
+class SendWindow {
+public:
+    explicit SendWindow(uint32_t seqno_step = 1) : slots(16) {
+        this->seqno_step = seqno_step;
+    }
+
+    // Sequence space each packet takes up. Only change this while the window is empty.
+    void setSeqnoStep(uint32_t seqno_step) { this->seqno_step = seqno_step; }
+
+    size_t size() const { return this->count; }
+    bool empty() const { return this->count == 0; }
+
+    // The i'th oldest packet.
+    P& operator[](size_t i) { return this->slots[(this->head + i) & (this->slots.size() - 1)]; }
+    P& front() { return (*this)[0]; }
+
+    // Append a packet, growing the ring if it is full.
+    void push_back(P&& packet) {
+        if (this->count == this->slots.size()) {
+            this->grow();
+        }
+        (*this)[this->count] = std::move(packet);
+        this->count++;
+    }
+
+    // Drop the oldest packet.
+    void pop_front() {
+        this->front() = P(); // Hands its buffer back.
+        this->head = (this->head + 1) & (this->slots.size() - 1);
+        this->count--;
+    }
+
+    // The packet with sequence number seqno, or NULL if there is none in the window.
+    P* find(uint32_t seqno) {
+        if (this->count == 0) {
+            return NULL;
+        }
+        uint32_t offset = seqno - this->front().header().seqno; // Wraps for seqnos before the window.
+        if (offset % this->seqno_step != 0 || offset / this->seqno_step >= this->count) {
+            return NULL;
+        }
+        P& packet = (*this)[offset / this->seqno_step];
+        return (packet.header().seqno == seqno)? &packet : NULL;
+    }
+
+    // How many packets from the i'th oldest on sit next to each other in memory,
+    // so that they can be handed to the kernel as one array.
+    size_t contiguous(size_t i) const {
+        size_t start = (this->head + i) & (this->slots.size() - 1);
+        size_t to_end = this->slots.size() - start;
+        size_t remaining = this->count - i;
+        return (remaining < to_end)? remaining : to_end;
+    }
+
+private:
+    std::vector<P> slots; // Size is always a power of two.
+    size_t head = 0;      // Slot of the oldest packet.
+    size_t count = 0;
+    uint32_t seqno_step;
+
+    // Double the ring, moving the packets to its start in order.
+    void grow() {
+        std::vector<P> bigger(this->slots.size() * 2);
+        for (size_t i = 0; i < this->count; i++) {
+            bigger[i] = std::move((*this)[i]);
+        }
+        this->slots.swap(bigger);
+        this->head = 0;
+    }
+};
@@ -2,9 +2,27 @@
 
 int main(int argc, char* argv[])
 {
-    if (argc < 2) {
-        fprintf(stderr, "Must provide port number. Usage: %s <server_portnumber>\n", argv[0]);
+    RdtOptions options;
+    int opt;
+    while ((opt = getopt(argc, argv, "ngm:")) != -1) {
+        switch (opt) {
+            case 'n': options.batch_io = false; break; // One syscall per datagram.
+            case 'g': options.gso = false; break;      // Batch, but without UDP GSO.
+            case 'm':                                  // Cap the packet size offered in the handshake.
+                options.max_pkt_size = atoi(optarg);
+                if (options.max_pkt_size < MIN_PKT_SIZE || options.max_pkt_size > MAX_PKT_SIZE) {
+                    fprintf(stderr, "Packet size must be between %d and %d bytes.\n", MIN_PKT_SIZE, MAX_PKT_SIZE);
+                    exit(1);
+                }
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n] [-g] [-m packet_size] <server_portnumber>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (argc - optind < 1) {
+        fprintf(stderr, "Must provide port number. Usage: %s [-n] [-g] [-m packet_size] <server_portnumber>\n", argv[0]);
         exit(1);
     }
-    new Server(argv[1]);
+    new Server(argv[optind], options);
 }
\ No newline at end of file
@@ -2,9 +2,38 @@
 
 int main(int argc, char* argv[])
 {
-    if (argc < 2) {
-        fprintf(stderr, "Must provide port number. Usage: %s <server_portnumber>\n", argv[0]);
+    RdtOptions options;
+    int opt;
+    while ((opt = getopt(argc, argv, "ngum:c:")) != -1) {
+        switch (opt) {
+            case 'n': options.batch_io = false; break; // One syscall per datagram.
+            case 'g': options.gso = false; break;      // Batch, but without UDP GSO.
+            case 'u': options.pacing = false; break;   // Send each window's packets back to back.
+            case 'm':                                  // Cap the packet size offered in the handshake.
+                options.max_pkt_size = atoi(optarg);
+                if (options.max_pkt_size < MIN_PKT_SIZE || options.max_pkt_size > MAX_PKT_SIZE) {
+                    fprintf(stderr, "Packet size must be between %d and %d bytes.\n", MIN_PKT_SIZE, MAX_PKT_SIZE);
+                    exit(1);
+                }
+                break;
+            case 'c': {                                // Congestion control: reno, cubic or bbr.
+                CongestionControl* cc = CongestionControl::create(optarg, DEFAULT_PKT_SIZE, INITIAL_WINDOW, INITIAL_SSTHRESH);
+                if (cc == NULL) {
+                    fprintf(stderr, "Congestion control must be reno, cubic or bbr.\n");
+                    exit(1);
+                }
+                delete cc;
+                options.congestion = optarg;
+                break;
+            }
+            default:
+                fprintf(stderr, "Usage: %s [-n] [-g] [-u] [-m packet_size] [-c reno|cubic|bbr] <server_portnumber>\n", argv[0]);
+                exit(1);
+        }
+    }
+    if (argc - optind < 1) {
+        fprintf(stderr, "Must provide port number. Usage: %s [-n] [-g] [-u] [-m packet_size] [-c reno|cubic|bbr] <server_portnumber>\n", argv[0]);
         exit(1);
     }
-    new Server(argv[1]);
+    new Server(argv[optind], options);
 }
\ No newline at end of file
@@ -0,0 +1,120 @@
+#include <time.h>
+
+#include "rdt.h"
+
+// Microbenchmark for the server's send window. Usage: ./window_bench [acks]
+// Fills windows of increasing size, then ACKs every packet but the oldest
+// before the oldest one's ACK comes in, as after a loss, and reports the cost
+// per ACK of marking the packet and sliding the window. For comparison it does
+// the same with the vector the window used to be, which rescans it on every ACK.
+
+const int PAYLOAD = DEFAULT_PKT_SIZE - HEADER_SIZE;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One window's worth of ACKs: the oldest packet's ACK arrives last.
+static uint32_t ackno(uint32_t base, size_t window, size_t i) {
+    return base + ((i + 1) % window) * PAYLOAD;
+}
+
+static double benchRing(size_t window, long rounds) {
+    SendWindow<Packet> sw(PAYLOAD);
+    uint32_t nextseqno = 0xffff0000u; // Cross the wrap along the way.
+    uint32_t baseseqno = nextseqno;
+    long acks = 0;
+
+    double start = now();
+    for (long r = 0; r < rounds; r++) {
+        while (sw.size() < window) {
+            sw.push_back(Packet(0, nextseqno, 0, NULL, PAYLOAD));
+            nextseqno += PAYLOAD;
+        }
+        uint32_t base = baseseqno;
+        for (size_t i = 0; i < window; i++) {
+            Packet* packet = sw.find(ackno(base, window, i));
+            if (packet != NULL) {
+                packet->acked = true;
+            }
+            while (!sw.empty() && sw.front().acked) {
+                baseseqno += sw.front().payloadSize();
+                sw.pop_front();
+            }
+            acks++;
+        }
+    }
+    double elapsed = now() - start;
+    if (!sw.empty()) {
+        fprintf(stderr, "Ring window not drained.\n");
+        exit(1);
+    }
+    return elapsed / acks * 1e9;
+}
+
+// The window as it was: a vector scanned to mark each ACK, then rescanned from
+// the start for every packet slid off the front.
+static double benchVector(size_t window, long rounds) {
+    vector<Packet> vw;
+    uint32_t nextseqno = 0xffff0000u;
+    uint32_t baseseqno = nextseqno;
+    long acks = 0;
+
+    double start = now();
+    for (long r = 0; r < rounds; r++) {
+        while (vw.size() < window) {
+            vw.push_back(Packet(0, nextseqno, 0, NULL, PAYLOAD));
+            nextseqno += PAYLOAD;
+        }
+        uint32_t base = baseseqno;
+        for (size_t i = 0; i < window; i++) {
+            uint32_t a = ackno(base, window, i);
+            for (Packet& packet : vw) {
+                if (packet.header().seqno == a) {
+                    packet.acked = true;
+                }
+            }
+            bool removed_one;
+            do {
+                removed_one = false;
+                for (vector<Packet>::iterator it = vw.begin(); it != vw.end();) {
+                    if (it->acked && it->header().seqno == baseseqno) {
+                        baseseqno += it->payloadSize();
+                        vw.erase(it);
+                        removed_one = true;
+                        break;
+                    } else {
+                        ++it;
+                    }
+                }
+            } while (removed_one);
+            acks++;
+        }
+    }
+    double elapsed = now() - start;
+    if (!vw.empty()) {
+        fprintf(stderr, "Vector window not drained.\n");
+        exit(1);
+    }
+    return elapsed / acks * 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    long total_acks = (argc > 1)? atol(argv[1]) : 1 << 20;
+
+    printf("%8s %14s %14s\n", "window", "ring ns/ack", "vector ns/ack");
+    for (size_t window = 16; window <= 8192; window *= 4) {
+        long rounds = total_acks / window;
+        if (rounds < 1) {
+            rounds = 1;
+        }
+        double ring = benchRing(window, rounds);
+        // The vector is quadratic; keep its run time bounded on big windows.
+        long vector_rounds = rounds / (window >= 1024? (long) (window / 256) : 1);
+        double vec = benchVector(window, vector_rounds < 1? 1 : vector_rounds);
+        printf("%8zu %14.1f %14.1f\n", window, ring, vec);
+    }
+    return 0;
+}